@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L // for `clock_gettime`, `open_memstream`, `popen`
+#include "lib/autodiff.h"
+#include "lib/pool.h"
+#include "lib/tape.h"
+#include "lib/tensor.h"
+#include "mlp.h"
+#include "utils.h"
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+// benchmarks of the autodiff core, the tensor layer and the generated MLP
+// kernels. results are printed one per line as the tab-separated name, value
+// and unit of a measurement, so runs can be diffed or collected over time to
+// catch regressions. every benchmark runs `REPEAT` times and the fastest run
+// is reported, as it is the one least disturbed by the rest of the system
+
+#define REPEAT 3      // runs of every benchmark
+#define NODES 1000000 // nodes built per run of `bench_construct`
+#define ROWS 64       // shape of the weight matrix of `bench_graph`, that of
+#define COLS 784      // the first layer of the MLP
+#define EXAMPLES 256  // examples per run of `bench_backprop`
+#define SAMPLES 64    // distinct random examples `bench_backprop` cycles over
+
+// compiler invocation for `bench_compile`, reading source code from standard
+// input. run from the root of the repo so the compiler finds runtime.h
+#define BENCH_CC "cc -O2 -Ilib/ -x c -c -o /dev/null -"
+
+// tape of the MLP saved by mlp-gen, also relative to the root of the repo
+#define BENCH_TAPE "bin/mlp.tape"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(char *name, double value, char *unit) {
+  printf("%s\t%g\t%s\n", name, value, unit);
+  fflush(stdout);
+}
+
+static void bench_construct(int cons) {
+  // build a long chain of nodes, with hash-consing enabled or not
+  struct arena *arena = arena_create(cons);
+  arena_use(arena);
+  double best = INFINITY;
+  for (int rep = 0; rep < REPEAT; rep++) {
+    arena_reset(arena);
+    double start = now();
+    struct node *x = node_lit(NAN), *acc = node_lit(0.0);
+    for (int i = 0; i < NODES / 3; i++)
+      acc = node_add(acc, node_mul(x, node_lit(i)));
+    best = fmin(best, now() - start);
+  }
+  arena_destroy(arena);
+  report(cons ? "node_construct.cons" : "node_construct", NODES / 3 * 3 / best,
+         "nodes/s");
+}
+
+static void bench_codegen(FILE *fp, struct node *c, struct tensor w,
+                          int *visited) {
+  // codegen `c` and the gradients of `w` into a function over an array of
+  // values, like `jit_compile` does
+  struct node *head = NULL;
+  int len = node_mark(c, &head, 0, ++*visited);
+  TENSOR_FOR(w) len = node_mark(node->grad, &head, len, *visited);
+  for (int i = len; i--; head = head->next)
+    head->id = i;
+
+  fprintf(fp, "#include \"runtime.h\"\n");
+  fprintf(fp, "void bench_kernel(real_t *v) {\n");
+  node_codegen(fp, "v[%d] = ", "v[%d]", c, ++*visited);
+  TENSOR_FOR(w) node_codegen(fp, "v[%d] = ", "v[%d]", node->grad, *visited);
+  fprintf(fp, "}\n");
+}
+
+static struct node *dense_relu(struct tensor w, struct tensor x) {
+  // returns the sum of the ReLU activations of a dense layer without biases,
+  // first giving random values to `w` and `x` and gradients to `w`
+  TENSOR_FOR(w) node->val = (double)rand() / RAND_MAX - 0.5;
+  TENSOR_FOR(x) node->val = (double)rand() / RAND_MAX;
+  TENSOR_FOR(w) node->grad = node_lit(0.0);
+  return tensor_sum(MOVE tensor_unop(node_relu, MOVE tensor_matmul(REF w,
+                                                                   REF x)));
+}
+
+static void bench_graph(void) {
+  // build the graph of a dense layer with a ReLU, differentiate it, then
+  // evaluate it and codegen it. `node_eval`, `tape_eval` and `tape_eval_levels`
+  // cover the forward graph only, and codegen covers the gradients too.
+  // `tape_eval_levels` runs on one thread per online processor
+  struct arena *arena = arena_create(1);
+  arena_use(arena);
+  double build = INFINITY, transposed = INFINITY, grad = INFINITY,
+         eval = INFINITY, tape_best = INFINITY, levels_best = INFINITY,
+         codegen = INFINITY;
+  int visited = 0, matmul = 0, fwd = 0, bwd = 0, depth = 0;
+  size_t bytes = 0;
+  struct pool *pool = pool_create(0);
+
+  for (int rep = 0; rep < REPEAT; rep++) {
+    arena_reset(arena);
+    struct tensor w = tensor_nans((shape_t){ROWS, COLS});
+    struct tensor x = col_tensor(MOVE tensor_nans((shape_t){COLS}));
+    double start = now();
+    struct tensor z = tensor_matmul(REF w, REF x);
+    build = fmin(build, now() - start);
+    matmul = 0, ++visited;
+    TENSOR_FOR(z) matmul = node_mark(node, NULL, matmul, visited);
+
+    // the same product through transposed views, as `(w x)^T = x^T w^T`.
+    // products are summed in the same order and hash-consing orders operands
+    // of `node_mul`, so both are built out of the very same nodes
+    start = now();
+    struct tensor zt = tensor_matmul(REF tensor_transpose(x, 0, 1),
+                                     REF tensor_transpose(w, 0, 1));
+    transposed = fmin(transposed, now() - start);
+    struct tensor ztt = tensor_transpose(zt, 0, 1);
+    int differs = tensor_reduce(node_add, REF z) !=
+                  tensor_reduce(node_add, REF ztt);
+    TENSOR_FOR(z) differs |= node != *tensor_at(&ztt, idx);
+    if (differs)
+      fprintf(stderr, "bench: transposed views differ\n"), exit(EXIT_FAILURE);
+    free(z.data), free(zt.data);
+
+    struct node *c = dense_relu(w, x);
+    fwd = node_mark(c, NULL, 0, ++visited);
+    start = now();
+    c->grad = node_lit(1.0), node_grad(c, ++visited);
+    grad = fmin(grad, now() - start);
+    bwd = node_mark(c, NULL, 0, ++visited);
+    TENSOR_FOR(w) bwd = node_mark(node->grad, NULL, bwd, visited);
+
+    start = now();
+    node_eval(c, ++visited);
+    eval = fmin(eval, now() - start);
+
+    struct tape tape = tape_compile(&c, 1, ++visited);
+    start = now();
+    tape_eval(&tape);
+    tape_best = fmin(tape_best, now() - start);
+    struct tape_levels levels = tape_levelize(&tape);
+    start = now();
+    tape_eval_levels(&tape, &levels, pool);
+    levels_best = fmin(levels_best, now() - start);
+    depth = levels.count;
+    tape_levels_free(&levels), tape_free(&tape);
+
+    char *src;
+    FILE *fp = open_memstream(&src, &bytes);
+    if (fp == NULL)
+      perror("open_memstream"), exit(EXIT_FAILURE);
+    start = now();
+    bench_codegen(fp, c, w, &visited);
+    if (fclose(fp) == EOF)
+      perror("fclose"), exit(EXIT_FAILURE);
+    codegen = fmin(codegen, now() - start);
+
+    free(src), free(x.data), free(w.data);
+  }
+  arena_destroy(arena), pool_destroy(pool);
+
+  report("tensor_matmul", build, "s");
+  report("tensor_matmul.transposed", transposed, "s");
+  report("tensor_matmul.nodes", matmul, "nodes");
+  report("node_grad", grad, "s");
+  report("node_grad.blowup", (double)bwd / fwd, "ratio");
+  report("node_eval", fwd / eval, "nodes/s");
+  report("tape_eval", fwd / tape_best, "nodes/s");
+  report("tape_eval_levels", fwd / levels_best, "nodes/s");
+  report("tape_eval_levels.levels", depth, "levels");
+  report("node_codegen", bytes / codegen, "bytes/s");
+}
+
+static void bench_compile(void) {
+  // compile the generated source of a layer a sixty-fourth the size of that
+  // of `bench_graph` once, as compiling is orders of magnitude slower than
+  // everything else. the source is piped to the compiler, timing both
+  struct arena *arena = arena_create(1);
+  arena_use(arena);
+  int visited = 0;
+  struct tensor w = tensor_nans((shape_t){ROWS / 8, COLS / 8});
+  struct tensor x = col_tensor(MOVE tensor_nans((shape_t){COLS / 8}));
+  struct node *c = dense_relu(w, x);
+  c->grad = node_lit(1.0), node_grad(c, ++visited);
+
+  char *src;
+  size_t bytes;
+  FILE *fp = open_memstream(&src, &bytes);
+  if (fp == NULL)
+    perror("open_memstream"), exit(EXIT_FAILURE);
+  bench_codegen(fp, c, w, &visited);
+  if (fclose(fp) == EOF)
+    perror("fclose"), exit(EXIT_FAILURE);
+  arena_destroy(arena);
+  free(x.data), free(w.data);
+
+  double start = now();
+  FILE *cc = popen(BENCH_CC, "w");
+  if (cc == NULL)
+    perror("popen"), exit(EXIT_FAILURE);
+  if (fwrite(src, 1, bytes, cc) != bytes || pclose(cc) != 0)
+    fprintf(stderr, "bench: `%s` failed\n", BENCH_CC), exit(EXIT_FAILURE);
+  double elapsed = now() - start;
+  free(src);
+  report("compile", elapsed, "s");
+  report("compile.rate", bytes / elapsed, "bytes/s");
+}
+
+static void bench_tape(void) {
+  // load the tape of the MLP saved by mlp-gen and check that evaluating it
+  // agrees with `mlp_backprop`, then evaluate it on one thread and level by
+  // level on one thread per online processor. unlike that of `bench_graph`,
+  // this tape has levels wide enough to be split across workers
+  static x_t x;
+  static y_t y;
+  static w_t w;
+  static dw_t dw;
+  static c_t c;
+  size_t x_size = sizeof x / sizeof *x, w_size = sizeof w / sizeof *w,
+         y_size = sizeof y / sizeof *y;
+
+  double start = now();
+  struct tape tape = tape_load(BENCH_TAPE);
+  double load = now() - start;
+  if ((size_t)tape.count != x_size + w_size + y_size + 1 + w_size)
+    fprintf(stderr, "%s: does not match mlp.h\n", BENCH_TAPE),
+        exit(EXIT_FAILURE);
+
+  // roots are the slots of x, w, y, c then dw
+  int *roots = tape.roots, *c_root = roots + x_size + w_size + y_size;
+  for (size_t i = 0; i < x_size; i++)
+    tape.vals[roots[i]] = x[i] = (double)rand() / RAND_MAX;
+  for (size_t i = 0; i < w_size; i++)
+    tape.vals[roots[x_size + i]] = w[i] = (double)rand() / RAND_MAX - 0.5;
+  for (size_t i = 0; i < y_size; i++)
+    tape.vals[roots[x_size + w_size + i]] = y[i] = i == 0;
+  mlp_backprop(x, w, y, dw, c);
+  tape_eval(&tape);
+  int differs = fabs(tape.vals[*c_root] - *c) > 1e-4 * (1.0 + fabs(*c));
+  for (size_t i = 0; i < w_size; i++)
+    differs |=
+        fabs(tape.vals[c_root[1 + i]] - dw[i]) > 1e-4 * (1.0 + fabs(dw[i]));
+  if (differs)
+    fprintf(stderr, "%s: does not agree with mlp_backprop\n", BENCH_TAPE),
+        exit(EXIT_FAILURE);
+
+  struct pool *pool = pool_create(0);
+  struct tape_levels levels = tape_levelize(&tape);
+  double eval = INFINITY, eval_levels = INFINITY;
+  for (int rep = 0; rep < REPEAT; rep++) {
+    start = now();
+    tape_eval(&tape);
+    eval = fmin(eval, now() - start);
+    start = now();
+    tape_eval_levels(&tape, &levels, pool);
+    eval_levels = fmin(eval_levels, now() - start);
+  }
+  report("mlp_tape.load", load, "s");
+  report("mlp_tape.eval", tape.len / eval, "nodes/s");
+  report("mlp_tape.eval_levels", tape.len / eval_levels, "nodes/s");
+  report("mlp_tape.levels", levels.count, "levels");
+  tape_levels_free(&levels), pool_destroy(pool), tape_free(&tape);
+}
+
+struct bench_batch {
+  x_t *xs;
+  y_t *ys;
+  w_t *w;
+  int batched; // whether to call `mlp_backprop_batch` or `mlp_backprop`
+  struct bench_worker {
+    scratch_t *s; // loaded with `w` once, if batched
+    dw_t dw;
+    c_t c;
+  } *workers;
+};
+
+static void backprop_task(void *arg, int worker, int begin, int end) {
+  struct bench_batch *b = arg;
+  struct bench_worker *wk = b->workers + worker;
+  if (!b->batched) {
+    for (int i = begin; i < end; i++)
+      mlp_backprop(b->xs[i % SAMPLES], *b->w, b->ys[i % SAMPLES], wk->dw,
+                   wk->c);
+    return;
+  }
+  x_t *x[MLP_LANES];
+  y_t *y[MLP_LANES];
+  for (int i = begin; i < end; i++)
+    x[i - begin] = b->xs + i % SAMPLES, y[i - begin] = b->ys + i % SAMPLES;
+  mlp_backprop_batch(end - begin, x, y, *wk->s, wk->dw, wk->c);
+}
+
+static void bench_backprop(int batched) {
+  // throughput of the generated MLP kernels over random examples, on one
+  // thread then on powers of two up to one thread per online processor
+  static x_t xs[SAMPLES];
+  static y_t ys[SAMPLES];
+  static w_t w;
+  for (int i = 0; i < SAMPLES; i++) {
+    for (size_t j = 0; j < sizeof *xs / sizeof **xs; j++)
+      xs[i][j] = (double)rand() / RAND_MAX;
+    for (size_t j = 0; j < sizeof *ys / sizeof **ys; j++)
+      ys[i][j] = j == (size_t)i % (sizeof *ys / sizeof **ys);
+  }
+  for (size_t j = 0; j < sizeof w / sizeof *w; j++)
+    w[j] = (double)rand() / RAND_MAX - 0.5;
+
+  struct pool *probe = pool_create(0);
+  int online = pool_threads(probe);
+  pool_destroy(probe);
+
+  for (int threads = 1;; threads *= 2) {
+    if (threads > online)
+      threads = online;
+    struct pool *pool = pool_create(threads);
+    struct bench_batch b = {xs, ys, &w, batched, NULL};
+    b.workers = calloc(threads, sizeof *b.workers);
+    for (int i = 0; batched && i < threads; i++) {
+      if ((b.workers[i].s = malloc(sizeof *b.workers[i].s)) == NULL)
+        perror("malloc"), exit(EXIT_FAILURE);
+      mlp_backprop_load(w, *b.workers[i].s);
+    }
+    double best = INFINITY;
+    for (int rep = 0; rep < REPEAT; rep++) {
+      double start = now();
+      pool_run(pool, EXAMPLES, MLP_LANES, backprop_task, &b);
+      best = fmin(best, now() - start);
+    }
+    for (int i = 0; i < threads; i++)
+      free(b.workers[i].s);
+    free(b.workers), pool_destroy(pool);
+
+    char name[64];
+    snprintf(name, sizeof name, "%s.threads_%d",
+             batched ? "mlp_backprop_batch" : "mlp_backprop", threads);
+    report(name, EXAMPLES / best, "examples/s");
+    if (threads == online)
+      break;
+  }
+}
+
+int main(void) {
+  srand(0);
+  bench_construct(0);
+  bench_construct(1);
+  bench_graph();
+  bench_compile();
+  bench_tape();
+  bench_backprop(0);
+  bench_backprop(1);
+}
@@ -1,4 +1,7 @@
 #include "lib/autodiff.h"
+#include "lib/pool.h"
+#include "lib/tape.h"
+#include "lib/jit.h"
 #include "lib/tensor.h"
 #include "utils.h"
 #include <stdlib.h>
@@ -8,6 +11,12 @@
 #define DEGREE 3      // degree of polynomial (plus one)
 #define ITERS 1000000 // number of update steps
 
+// 0 to jit compile the tape, or a number of threads to evaluate it level by
+// level across instead, for systems without a C compiler at runtime
+#ifndef LEVELS
+#define LEVELS 0
+#endif
+
 #define NPOINTS 20
 #define POINT_X(T) T
 #define POINT_Y(T) -0.06 * T *T + 1.0 * T + 5.0
@@ -17,6 +26,9 @@
 int main(void) {
   srand(time(NULL));
 
+  struct arena *arena = arena_create(1);
+  arena_use(arena);
+
   int visited = 0;
 
   struct tensor x = tensor_nans((shape_t){NPOINTS});
@@ -28,22 +40,60 @@ int main(void) {
 
   struct tensor y = tensor_nans(yh.shape);
   struct node *r2 = tensor_r2(REF y, REF yh);
+  int eliminated = node_mark(r2, NULL, 0, ++visited);
+  r2 = node_simplify(r2, ++visited);
+  eliminated -= node_mark(r2, NULL, 0, ++visited);
 
   TENSOR_FOR(w) node->grad = node_lit(0.0);
   r2->grad = node_lit(1.0), node_grad(r2, ++visited);
 
+  int before = node_mark(r2, NULL, 0, ++visited);
+  TENSOR_FOR(w) before = node_mark(node->grad, NULL, before, visited);
+  ++visited;
+  TENSOR_FOR(w) node->grad = node_simplify(node->grad, visited);
+  int after = node_mark(r2, NULL, 0, ++visited);
+  TENSOR_FOR(w) after = node_mark(node->grad, NULL, after, visited);
+  printf("%d nodes, %d eliminated\n", after, eliminated + before - after);
+
   TENSOR_FOR(x) node->val = POINT_X(idx) + NOISE_X(idx);
   TENSOR_FOR(y) node->val = POINT_Y(idx) + NOISE_Y(idx);
   TENSOR_FOR(w) node->val = (double)rand() / RAND_MAX - 0.5;
+
+  struct node *outs[1 + DEGREE] = {r2};
+  TENSOR_FOR(w) outs[1 + idx] = node->grad;
+  struct tape tape = tape_compile(outs, 1 + DEGREE, ++visited);
+  int r2_slot = tape_slot(&tape, r2), w_slots[DEGREE], dw_slots[DEGREE];
+  TENSOR_FOR(w) w_slots[idx] = tape_slot(&tape, node);
+  TENSOR_FOR(w) dw_slots[idx] = tape_slot(&tape, node->grad);
+#if LEVELS
+  struct pool *pool = pool_create(LEVELS);
+  struct tape_levels levels = tape_levelize(&tape);
+#else
+  struct jit jit = jit_compile(&tape, ++visited);
+#endif
+
+  double *vals = tape.vals;
   for (int iter = 0; iter < ITERS; iter++) {
-    node_eval(r2, ++visited);
-    TENSOR_FOR(w) node_eval(node->grad, visited);
-    TENSOR_FOR(w) node->val -= ETA * node->grad->val / shape_size(x.shape);
+#if LEVELS
+    tape_eval_levels(&tape, &levels, pool);
+#else
+    jit.eval(vals);
+#endif
+    for (int i = 0; i < DEGREE; i++)
+      vals[w_slots[i]] -= ETA * vals[dw_slots[i]] / shape_size(x.shape);
 
     if (iter % 1000 == 0)
-      printf("iter %d of %d; r2 %f\n", iter, ITERS, r2->val);
+      printf("iter %d of %d; r2 %f\n", iter, ITERS, vals[r2_slot]);
   }
 
+  TENSOR_FOR(w) node->val = vals[w_slots[idx]];
+#if LEVELS
+  tape_levels_free(&levels), pool_destroy(pool);
+#else
+  jit_free(&jit);
+#endif
+  tape_free(&tape);
+
 #define STRINGIZE_INNER(...) #__VA_ARGS__
 #define STRINGIZE(...) STRINGIZE_INNER(__VA_ARGS__)
 
@@ -57,7 +107,6 @@ int main(void) {
 #undef STRINGIZE_INNER
 #undef STRINGIZE
 
-  struct node *nodes = NULL;
-  node_mark(r2, &nodes, 0, ++visited), node_free(nodes, visited);
+  arena_destroy(arena);
   free(x.data), free(yh.data), free(w.data), free(y.data);
 }
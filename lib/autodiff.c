@@ -1,29 +1,168 @@
 #include "autodiff.h"
 #include "runtime.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 static int node_id = 0;
 
+static struct node_timings timings; // see `node_timings`
+
+static double node_clock(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define ARENA_BLOCK 65536 // number of nodes per arena block
+
+struct block {
+  struct block *next;
+  struct node nodes[ARENA_BLOCK];
+};
+
+struct arena {
+  struct block *head, *cur; // first block and block currently being carved
+  size_t used;              // number of nodes carved out of `cur`
+  struct node **table;      // hash-consing table, or `NULL` if disabled
+  size_t cap, len;          // capacity and occupancy of `table`
+};
+
+static struct arena *cur_arena = NULL; // see `arena_use`
+
+struct arena *arena_create(int cons) {
+  // if `cons` is nonzero, node constructors hash-cons while `arena` is in use,
+  // returning an existing node of `arena` when one with the same `type`,
+  // `lhs`, `rhs` and literal `val` exists. `node_lit(NAN)`s are never shared,
+  // so they can still be used as inputs, but other literals must then not
+  // have their `val` mutated
+  struct arena *arena = malloc(sizeof *arena);
+  arena->head = arena->cur = malloc(sizeof *arena->head);
+  arena->head->next = NULL, arena->used = 0;
+  arena->cap = cons ? 1024 : 0, arena->len = 0;
+  arena->table = cons ? calloc(arena->cap, sizeof *arena->table) : NULL;
+  return arena;
+}
+
+void arena_reset(struct arena *arena) {
+  // release all nodes allocated from `arena`. blocks are kept around and
+  // reused by subsequent allocations. takes constant time unless hash-consing
+  arena->cur = arena->head, arena->used = 0;
+  if (arena->table)
+    memset(arena->table, 0, arena->cap * sizeof *arena->table), arena->len = 0;
+}
+
+void arena_destroy(struct arena *arena) {
+  if (cur_arena == arena)
+    cur_arena = NULL;
+  for (struct block *next, *block = arena->head; block; block = next)
+    next = block->next, free(block);
+  free(arena->table), free(arena);
+}
+
+struct arena *arena_use(struct arena *arena) {
+  // make node constructors allocate from `arena`, or from the heap if `arena`
+  // is `NULL`. returns the arena previously in use
+  struct arena *prev = cur_arena;
+  cur_arena = arena;
+  return prev;
+}
+
+static struct node *node_alloc(void) {
+  struct arena *arena = cur_arena;
+  if (arena == NULL)
+    return malloc(sizeof(struct node));
+
+  if (arena->used == ARENA_BLOCK) {
+    if (arena->cur->next == NULL)
+      arena->cur->next = malloc(sizeof *arena->cur->next),
+      arena->cur->next->next = NULL;
+    arena->cur = arena->cur->next, arena->used = 0;
+  }
+
+  return arena->cur->nodes + arena->used++;
+}
+
+static uint64_t node_hash(struct node *node) {
+  uint64_t hash = node->type, bits = 0;
+  if (node->type == NODE_LIT)
+    memcpy(&bits, &node->val, sizeof node->val);
+  hash = (hash ^ (uintptr_t)node->lhs) * 0x100000001b3;
+  hash = (hash ^ (uintptr_t)node->rhs) * 0x100000001b3;
+  hash = (hash ^ bits) * 0x100000001b3;
+  return hash ^ hash >> 32;
+}
+
+static int node_same(struct node *lhs, struct node *rhs) {
+  return lhs->type == rhs->type && lhs->lhs == rhs->lhs &&
+         lhs->rhs == rhs->rhs &&
+         (lhs->type != NODE_LIT ||
+          memcmp(&lhs->val, &rhs->val, sizeof lhs->val) == 0);
+}
+
+static struct node **arena_lookup(struct arena *arena, struct node *node) {
+  // returns the slot of `arena->table` holding a node identical to `node`, or
+  // the empty slot where it should be inserted. `arena->cap` is a power of two
+  size_t mask = arena->cap - 1, idx = node_hash(node) & mask;
+  while (arena->table[idx] && !node_same(arena->table[idx], node))
+    idx = (idx + 1) & mask;
+  return arena->table + idx;
+}
+
+static void arena_grow(struct arena *arena) {
+  struct node **table = arena->table;
+  size_t cap = arena->cap;
+  arena->cap *= 2;
+  arena->table = calloc(arena->cap, sizeof *arena->table);
+  for (size_t idx = 0; idx < cap; idx++)
+    if (table[idx])
+      *arena_lookup(arena, table[idx]) = table[idx];
+  free(table);
+}
+
+static struct node *node_new(struct node node) {
+  // allocate a copy of `node`, or return an existing identical node if the
+  // arena in use hash-conses. operands of commutative nodes are ordered by
+  // `id` so that `node_add(a, b)` and `node_add(b, a)` are shared too
+  struct arena *arena = cur_arena;
+  struct node **slot = NULL;
+
+  if (arena && arena->table && !(node.type == NODE_LIT && isnan(node.val))) {
+    int commutative = node.type == NODE_ADD || node.type == NODE_MUL ||
+                      node.type == NODE_MIN || node.type == NODE_MAX;
+    if (commutative && node.lhs->id > node.rhs->id) {
+      struct node *lhs = node.lhs;
+      node.lhs = node.rhs, node.rhs = lhs;
+    }
+
+    if (2 * (arena->len + 1) > arena->cap)
+      arena_grow(arena);
+    if (*(slot = arena_lookup(arena, &node)))
+      return *slot;
+  }
+
+  struct node *new = node_alloc();
+  *new = node, new->id = node_id++;
+  if (slot)
+    *slot = new, arena->len++;
+  return new;
+}
+
 #define DEF_LIT(UC, LC)                                                        \
   struct node *node_##LC(double val) {                                         \
-    struct node *node = malloc(sizeof *node);                                  \
-    *node = (struct node){.type = NODE_##UC, .id = node_id++, .val = val};     \
-    return node;                                                               \
+    return node_new((struct node){.type = NODE_##UC, .val = val});             \
   }
 
 #define DEF_UNOP(UC, LC)                                                       \
   struct node *node_##LC(struct node *lhs) {                                   \
-    struct node *node = malloc(sizeof *node);                                  \
-    *node = (struct node){.type = NODE_##UC, .id = node_id++, .lhs = lhs};     \
-    return node;                                                               \
+    return node_new((struct node){.type = NODE_##UC, .lhs = lhs});             \
   }
 
 #define DEF_BINOP(UC, LC)                                                      \
   struct node *node_##LC(struct node *lhs, struct node *rhs) {                 \
-    struct node *node = malloc(sizeof *node);                                  \
-    *node = (struct node){                                                     \
-        .type = NODE_##UC, .id = node_id++, .lhs = lhs, .rhs = rhs};           \
-    return node;                                                               \
+    return node_new(                                                           \
+        (struct node){.type = NODE_##UC, .lhs = lhs, .rhs = rhs});             \
   }
 
 NODE_TYPES(DEF_LIT, DEF_UNOP, DEF_BINOP)
@@ -32,25 +171,80 @@ NODE_TYPES(DEF_LIT, DEF_UNOP, DEF_BINOP)
 #undef DEF_UNOP
 #undef DEF_BINOP
 
+static double node_apply(struct node *node);
+
+static struct node **node_walk(struct node *node, int *count, int eval,
+                               int visited) {
+  // mark `node` and its dependencies as `visited` and return an array of the
+  // newly marked nodes in topological order, that is, in the order a depth-
+  // first traversal visiting `lhs` before `rhs` would finish them. stores
+  // their number in `*count`. if `eval` is nonzero, evaluates nodes as they
+  // are finished instead and returns `NULL`. uses an explicit stack rather
+  // than recursion so that graph depth is bounded only by the heap
+
+  struct frame {
+    struct node *node;
+    int expanded; // whether the child nodes of `node` were pushed already
+  } stack_buf[256], *stack = stack_buf;
+  size_t cap = 256, top = 0, len = 0, size = eval ? 0 : 64;
+  struct node **nodes = eval ? NULL : malloc(sizeof *nodes * size);
+
+  stack[top++] = (struct frame){node, 0};
+  while (top) {
+    struct frame frame = stack[--top];
+
+    if (frame.expanded) {
+      if (eval)
+        frame.node->val = node_apply(frame.node);
+      else if (len == size)
+        nodes = realloc(nodes, sizeof *nodes * (size *= 2));
+      if (!eval)
+        nodes[len] = frame.node;
+      len++;
+      continue;
+    }
+
+    if (frame.node->visited == visited)
+      continue;
+
+    if (top + 3 > cap) {
+      struct frame *grown = malloc(sizeof *stack * (cap *= 2));
+      memcpy(grown, stack, sizeof *stack * top);
+      if (stack != stack_buf)
+        free(stack);
+      stack = grown;
+    }
+    frame.node->visited = visited;
+    stack[top++] = (struct frame){frame.node, 1};
+    if (frame.node->rhs && frame.node->rhs->visited != visited)
+      stack[top++] = (struct frame){frame.node->rhs, 0};
+    if (frame.node->lhs && frame.node->lhs->visited != visited)
+      stack[top++] = (struct frame){frame.node->lhs, 0};
+  }
+
+  if (stack != stack_buf)
+    free(stack);
+  *count = len;
+  return nodes;
+}
+
 int node_mark(struct node *node, struct node **head, int count, int visited) {
   // mark `node` and its dependencies as `visited` and store them in the
   // linked list formed by `next` fields starting at `head` in reverse
   // topological order. pass in `head = NULL` to discard the linked list.
   // call with `count = 0`. returns the number of nodes marked
 
-  if (node->visited == visited)
-    return count;
-
-  node->visited = visited, count++;
-  if (node->lhs)
-    count = node_mark(node->lhs, head, count, visited);
-  if (node->rhs)
-    count = node_mark(node->rhs, head, count, visited);
+  double start = node_clock();
+  int len;
+  struct node **nodes = node_walk(node, &len, 0, visited);
 
   if (head != NULL)
-    node->next = *head, *head = node;
+    for (int i = 0; i < len; i++)
+      nodes[i]->next = *head, *head = nodes[i];
 
-  return count;
+  free(nodes);
+  timings.mark += node_clock() - start, timings.mark_calls++;
+  return count + len;
 }
 
 void node_free(struct node *head, int visited) {
@@ -72,27 +266,12 @@ void node_zerograd(struct node *head, int visited) {
     node_free(grads, visited);
 }
 
-void node_codegen(FILE *fp, char *decl_fmt, char *ref_fmt, struct node *node,
-                  int visited) {
-  // codegen node into C source code. `decl_fmt` and `ref_fmt` are format
-  // strings that specify how to declare temporaries and refer to temporaries,
-  // respectively. codegens nothing for `node_lit(NAN)`s, so they can be used
-  // as inputs. make sure to call with a unique `visited`
-
-  if (node->visited == visited)
-    return;
-
-  node->visited = visited;
-  if (node->lhs)
-    node_codegen(fp, decl_fmt, ref_fmt, node->lhs, visited);
-  if (node->rhs)
-    node_codegen(fp, decl_fmt, ref_fmt, node->rhs, visited);
+static void node_emit(FILE *fp, char *decl_fmt, char *ref_fmt,
+                      struct node *node) {
+  // codegen the single statement computing `node`. see `node_codegen`
 
-  if (node->type == NODE_LIT && isnan(node->val))
-    return;
-
-    // passing in `node->id` several times so that the `ref_fmt` and `decl_fmt`
-    // format strings can refer to a node's ID several times if needed
+  // passing in `node->id` several times so that the `ref_fmt` and `decl_fmt`
+  // format strings can refer to a node's ID several times if needed
 #define GEN_REF(NODE) fprintf(fp, ref_fmt, NODE->id, NODE->id, NODE->id)
   fprintf(fp, decl_fmt, node->id, node->id, node->id);
 
@@ -104,8 +283,12 @@ void node_codegen(FILE *fp, char *decl_fmt, char *ref_fmt, struct node *node,
      * `NAN` for <math.h> would be futile because it is implementation-defined \
      * whether infinity converts to 'INF' or to 'INFINITY' and whether NaN     \
      * converts to 'NAN' or to 'NAN(n-char-sequence)'; see ISO/IEC 9899:TC3,   \
-     * $7.19.6.1, paragraph 8, conversion specifiers 'f,F' */                  \
-    fprintf(fp, "op_" #LC "(%#a)", node->val);                                 \
+     * $7.19.6.1, paragraph 8, conversion specifiers 'f,F'. infinities are     \
+     * spelled `HUGE_VAL`, which is infinity under IEC 60559 */                \
+    if (isinf(node->val))                                                      \
+      fprintf(fp, "op_" #LC "(%sHUGE_VAL)", node->val < 0 ? "-" : "");         \
+    else                                                                       \
+      fprintf(fp, "op_" #LC "(%#a)", node->val);                               \
     break;
 #define GEN_UNOP(UC, LC)                                                       \
   case NODE_##UC:                                                              \
@@ -128,132 +311,707 @@ void node_codegen(FILE *fp, char *decl_fmt, char *ref_fmt, struct node *node,
 #undef GEN_REF
 }
 
-void node_eval(struct node *node, int visited) {
-  // evaluate the value of `node` and its dependencies and store results in
-  // `val` fields. make sure all dependencies of type `NODE_LIT` actually
-  // hold a literal in their `val`. make sure to call with a unique `visited`
+void node_codegen(FILE *fp, char *decl_fmt, char *ref_fmt, struct node *node,
+                  int visited) {
+  // codegen node into C source code. `decl_fmt` and `ref_fmt` are format
+  // strings that specify how to declare temporaries and refer to temporaries,
+  // respectively. codegens nothing for `node_lit(NAN)`s, so they can be used
+  // as inputs. make sure to call with a unique `visited`
+
+  double start = node_clock();
+  int len;
+  struct node **nodes = node_walk(node, &len, 0, visited);
 
-  if (node->visited == visited)
-    return;
+  for (int i = 0; i < len; i++)
+    if (nodes[i]->type != NODE_LIT || !isnan(nodes[i]->val))
+      node_emit(fp, decl_fmt, ref_fmt, nodes[i]);
 
-  node->visited = visited;
-  if (node->lhs)
-    node_eval(node->lhs, visited);
-  if (node->rhs)
-    node_eval(node->rhs, visited);
+  free(nodes);
+  timings.codegen += node_clock() - start, timings.codegen_calls++;
+}
+
+static int node_input(struct node *node) {
+  return node->type == NODE_LIT && isnan(node->val);
+}
+
+int node_slots(struct node *nodes[], int count, int first, int visited) {
+  // renumber the `id`s of the `count` nodes of `nodes` and their dependencies
+  // so that nodes whose values are never live at the same time share an ID,
+  // letting `node_codegen` reuse temporaries. IDs handed out are `first` and
+  // up, and their number, the peak number of live values, is returned. `id`s
+  // of `node_lit(NAN)`s are left untouched. liveness follows the order in
+  // which calling `node_codegen` on each of `nodes` in turn with a shared
+  // `visited` emits temporaries, and the value of each of `nodes` is live
+  // until the next call, so read it right after its own call. temporaries
+  // are then assigned several times, so declare them beforehand.
+  // IDs order the operands of hash-consed nodes, so only renumber nodes once
+  // done building graphs. make sure to call with a unique `visited`
+
+  struct node **order = NULL;
+  int len = 0, *ends = malloc(sizeof *ends * count);
+  for (int i = 0; i < count; i++) {
+    int walked;
+    struct node **walk = node_walk(nodes[i], &walked, 0, visited);
+    order = realloc(order, sizeof *order * (len + walked));
+    memcpy(order + len, walk, sizeof *order * walked), len += walked;
+    ends[i] = len, free(walk);
+  }
+
+  // borrow `id` fields to hold the position of every node in `order`. the
+  // value of the node at position `q` dies at position `last[q]`
+  int *last = malloc(sizeof *last * len), *slot = malloc(sizeof *slot * len);
+  for (int p = 0; p < len; p++)
+    if (!node_input(order[p]))
+      order[p]->id = p, last[p] = p;
+  for (int p = 0; p < len; p++) {
+    if (order[p]->lhs && !node_input(order[p]->lhs))
+      last[order[p]->lhs->id] = p;
+    if (order[p]->rhs && !node_input(order[p]->rhs))
+      last[order[p]->rhs->id] = p;
+  }
+  for (int i = 0; i < count; i++)
+    if (!node_input(nodes[i]) && last[nodes[i]->id] < ends[i])
+      last[nodes[i]->id] = ends[i];
+
+  // bucket values by the position they die at, then hand out slots in order.
+  // values dying at `p` free their slot before `p` takes one, which is fine
+  // because C evaluates operands before assigning the result
+  int *dying = malloc(sizeof *dying * len);
+  int *chain = malloc(sizeof *chain * len);
+  int *idle = malloc(sizeof *idle * len), idles = 0, peak = 0;
+  for (int p = 0; p < len; p++)
+    dying[p] = -1;
+  for (int q = 0; q < len; q++)
+    if (!node_input(order[q]) && last[q] != q && last[q] < len)
+      chain[q] = dying[last[q]], dying[last[q]] = q;
+
+  for (int p = 0; p < len; p++) {
+    for (int q = dying[p]; q != -1; q = chain[q])
+      idle[idles++] = slot[q];
+    if (node_input(order[p]))
+      continue;
+    slot[p] = idles ? idle[--idles] : peak++;
+    if (last[p] == p)
+      idle[idles++] = slot[p]; // never used
+  }
+
+  for (int p = 0; p < len; p++)
+    if (!node_input(order[p]))
+      order[p]->id = first + slot[p];
+
+  free(order), free(ends), free(last), free(slot);
+  free(dying), free(chain), free(idle);
+  return peak;
+}
 
+static double node_apply(struct node *node) {
+  // apply the operation of `node` to the `val`s of its child nodes
   switch (node->type) {
     // see runtime.h
-#define EVAL_LIT(UC, LC)                                                       \
+#define APPLY_LIT(UC, LC)                                                      \
   case NODE_##UC:                                                              \
-    node->val = op_##LC(node->val);                                            \
-    break;
-#define EVAL_UNOP(UC, LC)                                                      \
+    return op_##LC(node->val);
+#define APPLY_UNOP(UC, LC)                                                     \
   case NODE_##UC:                                                              \
-    node->val = op_##LC(node->lhs->val);                                       \
-    break;
-#define EVAL_BINOP(UC, LC)                                                     \
+    return op_##LC(node->lhs->val);
+#define APPLY_BINOP(UC, LC)                                                    \
   case NODE_##UC:                                                              \
-    node->val = op_##LC(node->lhs->val, node->rhs->val);                       \
-    break;
+    return op_##LC(node->lhs->val, node->rhs->val);
+
+    NODE_TYPES(APPLY_LIT, APPLY_UNOP, APPLY_BINOP)
+
+#undef APPLY_LIT
+#undef APPLY_UNOP
+#undef APPLY_BINOP
+  }
+
+  abort(); // unreachable
+}
+
+void node_eval(struct node *node, int visited) {
+  // evaluate the value of `node` and its dependencies and store results in
+  // `val` fields. make sure all dependencies of type `NODE_LIT` actually
+  // hold a literal in their `val`. make sure to call with a unique `visited`
+
+  double start = node_clock();
+  int len;
+  node_walk(node, &len, 1, visited);
+  timings.eval += node_clock() - start, timings.eval_calls++;
+}
+
+static int node_is(struct node *node, double val) {
+  return node->type == NODE_LIT && node->val == val;
+}
+
+static int node_const(struct node *node) {
+  return node->type == NODE_LIT && !isnan(node->val);
+}
+
+static struct node *node_rewrite(struct node *node) {
+  // returns a node equivalent to `node`, assuming its child nodes are already
+  // rewritten. values are assumed finite, so that `x * 0.0` is `0.0`
+  struct node *lhs = node->lhs, *rhs = node->rhs;
+
+  if (node->type != NODE_LIT && node_const(lhs) && (!rhs || node_const(rhs)))
+    return node_lit(node_apply(node)); // constant folding
+
+  switch (node->type) {
+  case NODE_ADD:
+    return node_is(lhs, 0.0) ? rhs : node_is(rhs, 0.0) ? lhs : node;
+  case NODE_SUB:
+    if (lhs == rhs)
+      return node_lit(0.0);
+    return node_is(rhs, 0.0)   ? lhs
+           : node_is(lhs, 0.0) ? node_rewrite(node_neg(rhs))
+                               : node;
+  case NODE_NEG:
+    return lhs->type == NODE_NEG ? lhs->lhs : node;
+  case NODE_MUL:
+    if (node_is(lhs, 0.0) || node_is(rhs, 0.0))
+      return node_lit(0.0);
+    if (node_is(lhs, -1.0) || node_is(rhs, -1.0))
+      return node_rewrite(node_neg(node_is(lhs, -1.0) ? rhs : lhs));
+    return node_is(lhs, 1.0) ? rhs : node_is(rhs, 1.0) ? lhs : node;
+  case NODE_DIV:
+    if (node_is(lhs, 0.0))
+      return node_lit(0.0);
+    return node_is(rhs, 1.0)   ? lhs
+           : node_is(lhs, 1.0) ? node_rewrite(node_inv(rhs))
+                               : node;
+  case NODE_INV:
+    return lhs->type == NODE_INV ? lhs->lhs : node;
+  case NODE_POW:
+    return node_is(rhs, 1.0) ? lhs : node_is(rhs, 0.0) ? node_lit(1.0) : node;
+  case NODE_MIN:
+  case NODE_MAX:
+    return lhs == rhs ? lhs : node;
+  case NODE_LOGADDEXP:
+    return node_is(lhs, -INFINITY) ? rhs : node_is(rhs, -INFINITY) ? lhs : node;
+  default:
+    return node;
+  }
+}
+
+struct node *node_simplify(struct node *node, int visited) {
+  // algebraically simplify `node` and its dependencies, folding constants and
+  // eliminating operations with identity and absorbing elements. returns the
+  // simplified `node`. rewrites child pointers in place and leaves the `next`
+  // field of every visited node pointing to its simplified node. can be called
+  // on several nodes sharing a `visited`, so long as `next` fields are left
+  // untouched in between. all `NODE_LIT`s except `node_lit(NAN)`s are assumed
+  // to be constants. make sure to call with a unique `visited`
+
+  int count;
+  struct node **nodes = node_walk(node, &count, 0, visited);
+
+  for (int i = 0; i < count; i++) {
+    struct node *node = nodes[i];
+    if (node->lhs)
+      node->lhs = node->lhs->next;
+    if (node->rhs)
+      node->rhs = node->rhs->next;
+    node->next = node_rewrite(node);
+  }
+
+  free(nodes);
+  return node->next;
+}
 
-    NODE_TYPES(EVAL_LIT, EVAL_UNOP, EVAL_BINOP)
+struct node_index {
+  // positions of nodes in an array from `node_walk`, in an open-addressing
+  // table keyed by address. `id` fields can't be borrowed for this while new
+  // nodes are being made, as `node_new` orders operands by them
+  struct node **nodes;
+  int *table; // positions in `nodes`, or -1 for empty slots
+  int bits;   // base-2 logarithm of the length of `table`
+};
+
+#define NODE_SLOT(INDEX, NODE)                                                 \
+  ((uint64_t)(uintptr_t)(NODE) * 0x9e3779b97f4a7c15 >> (64 - (INDEX)->bits))
+
+static struct node_index node_index(struct node *nodes[], int count) {
+  struct node_index index = {nodes, NULL, 1};
+  while (1 << index.bits < 2 * count)
+    index.bits++;
+  size_t mask = ((size_t)1 << index.bits) - 1;
+  index.table = malloc(sizeof *index.table * (mask + 1));
+  for (size_t i = 0; i <= mask; i++)
+    index.table[i] = -1;
+  for (int i = 0; i < count; i++) {
+    size_t slot = NODE_SLOT(&index, nodes[i]);
+    while (index.table[slot] != -1)
+      slot = (slot + 1) & mask;
+    index.table[slot] = i;
+  }
+  return index;
+}
 
-#undef EVAL_LIT
-#undef EVAL_UNOP
-#undef EVAL_BINOP
+static int node_find(struct node_index *index, struct node *node) {
+  // returns the position of `node`, which must be in the array. aborts
+  // otherwise, once probing reaches an empty slot
+  size_t mask = ((size_t)1 << index->bits) - 1, slot = NODE_SLOT(index, node);
+  for (size_t probes = 0; probes <= mask; probes++) {
+    if (index->table[slot] == -1)
+      break;
+    if (index->nodes[index->table[slot]] == node)
+      return index->table[slot];
+    slot = (slot + 1) & mask;
   }
+  abort();
+}
+
+#undef NODE_SLOT
+
+static struct node *node_chain(struct node *local, struct node *grad) {
+  // chain rule. the seed `node_lit(1.0)` is an identity, so chains through
+  // nodes on which `node` depends linearly cost no multiplication
+  return node_is(grad, 1.0) ? local : node_mul(local, grad);
+}
+
+static struct node *node_sum(struct node *terms[], int count) {
+  // sums `terms` pairwise, which keeps the result shallow where a chain of
+  // `count - 1` additions would be as deep. clobbers `terms`
+  for (; count > 1; count = (count + 1) / 2)
+    for (int i = 0; i < count; i += 2)
+      terms[i / 2] =
+          i + 1 < count ? node_add(terms[i], terms[i + 1]) : terms[i];
+  return terms[0];
 }
 
 void node_grad(struct node *node, int visited) {
   // compute derivative of `node` and its dependencies with respect to `node`
   // and store results in `grad` fields. before calling make sure that all
   // dependencies' `grad`s hold either `NULL` or `node_lit(0.0)` and that
-  // `node->grad` is `node_lit(1.0)`. make sure to call with a unique `visited`
-
-  struct node *head = NULL;
-  node_mark(node, &head, 0, visited); // reverse topological order
-
-  for (; head; head = head->next) {
-    struct node *lhs_grad = NULL, *rhs_grad = NULL;
-
-    // derivatives of `head->lhs` and `head->rhs` with respect to `head`
+  // `node->grad` is `node_lit(1.0)`. a `NULL` or `node_lit(0.0)` is left in
+  // place for derivatives that are zero regardless of values, and dropped
+  // otherwise. make sure to call with a unique `visited`
+
+  double start = node_clock();
+  int count;
+  struct node **nodes = node_walk(node, &count, 0, visited);
+
+  // the gradient terms contributed to a node by the nodes depending on it are
+  // kept as a linked list through `terms`, starting at `first[i]` for the node
+  // at `nodes[i]`, and summed at once when that node is reached
+  struct node_index index = node_index(nodes, count);
+  int *first = malloc(sizeof *first * count);
+  struct term {
+    struct node *grad;
+    int next;
+  } *terms = malloc(sizeof *terms * 2 * count);
+  struct node **sum = malloc(sizeof *sum * (2 * count + 1));
+  int len = 0;
+  for (int i = 0; i < count; i++)
+    first[i] = -1;
+
+  for (int i = count - 1; i >= 0; i--) {
+    struct node *head = nodes[i], *grad = head->grad;
+    int n = 0;
+
+    // gradient accumulation
+    if (grad && !node_is(grad, 0.0))
+      sum[n++] = grad;
+    for (int t = first[i]; t != -1; t = terms[t].next)
+      sum[n++] = terms[t].grad;
+    if (n)
+      head->grad = grad = node_sum(sum, n);
+    if (grad == NULL || node_is(grad, 0.0))
+      continue;
+
+    // derivatives of `head->lhs` and `head->rhs` with respect to `node`,
+    // through `head`. `NULL` when zero regardless of values
+    struct node *lhs_grad = NULL, *rhs_grad = NULL, *local;
     switch (head->type) {
     case NODE_LIT:
       break;
     case NODE_ADD:
-      lhs_grad = node_lit(1.0);
-      rhs_grad = lhs_grad;
+      lhs_grad = grad;
+      rhs_grad = grad;
       break;
     case NODE_SUB:
-      lhs_grad = node_lit(1.0);
-      rhs_grad = node_lit(-1.0);
+      lhs_grad = grad;
+      rhs_grad = node_neg(grad);
       break;
     case NODE_NEG:
-      lhs_grad = node_lit(-1.0);
+      lhs_grad = node_neg(grad);
       break;
     case NODE_MUL:
-      lhs_grad = head->rhs;
-      rhs_grad = head->lhs;
+      lhs_grad = node_chain(head->rhs, grad);
+      rhs_grad = node_chain(head->lhs, grad);
       break;
     case NODE_DIV:
-      lhs_grad = node_inv(head->rhs);
-      rhs_grad = node_neg(node_mul(head, lhs_grad));
+      local = node_inv(head->rhs);
+      lhs_grad = node_chain(local, grad);
+      rhs_grad = node_chain(node_neg(node_mul(head, local)), grad);
       break;
     case NODE_INV:
-      lhs_grad = node_neg(node_div(head, head->lhs));
+      lhs_grad = node_chain(node_neg(node_div(head, head->lhs)), grad);
       break;
     case NODE_EXP:
-      lhs_grad = head;
+      lhs_grad = node_chain(head, grad);
       break;
     case NODE_LOG:
-      lhs_grad = node_inv(head->lhs);
+      lhs_grad = node_is(grad, 1.0) ? node_inv(head->lhs)
+                                    : node_div(grad, head->lhs);
       break;
     case NODE_EXP2:
-      lhs_grad = node_mul(head, node_log(head->lhs));
+      lhs_grad = node_chain(node_mul(head, node_lit(log(2.0))), grad);
       break;
     case NODE_LOG2:
-      lhs_grad = node_inv(node_mul(head->lhs, node_lit(log(2.0))));
+      lhs_grad = node_chain(node_inv(node_mul(head->lhs, node_lit(log(2.0)))),
+                            grad);
       break;
     case NODE_POW:
-      lhs_grad = node_mul(head->rhs, node_div(head, head->lhs));
-      rhs_grad = node_mul(head, node_log(head->lhs));
+      lhs_grad =
+          node_chain(node_mul(head->rhs, node_div(head, head->lhs)), grad);
+      rhs_grad = node_chain(node_mul(head, node_log(head->lhs)), grad);
       break;
     case NODE_SQRT:
-      lhs_grad = node_inv(node_mul(node_lit(2.0), head));
+      lhs_grad = node_chain(node_inv(node_mul(node_lit(2.0), head)), grad);
       break;
     case NODE_CBRT:
-      lhs_grad = node_div(head, node_mul(node_lit(3.0), head->lhs));
+      lhs_grad =
+          node_chain(node_div(head, node_mul(node_lit(3.0), head->lhs)), grad);
+      break;
+    case NODE_MIN:
+      local = node_step(node_sub(head->rhs, head->lhs));
+      lhs_grad = node_chain(local, grad);
+      rhs_grad = node_chain(node_sub(node_lit(1.0), local), grad);
       break;
-    case NODE_MIN:;
-      struct node *sub_rhs_lhs = node_sub(head->rhs, head->lhs);
-      lhs_grad = node_div(node_relu(sub_rhs_lhs), sub_rhs_lhs);
-      rhs_grad = node_sub(node_lit(1.0), lhs_grad);
+    case NODE_MAX:
+      local = node_step(node_sub(head->lhs, head->rhs));
+      lhs_grad = node_chain(local, grad);
+      rhs_grad = node_chain(node_sub(node_lit(1.0), local), grad);
       break;
-    case NODE_MAX:;
-      struct node *sub_lhs_rhs = node_sub(head->lhs, head->rhs);
-      lhs_grad = node_div(node_relu(sub_lhs_rhs), sub_lhs_rhs);
-      rhs_grad = node_sub(node_lit(1.0), lhs_grad);
+    case NODE_RELU:
+      lhs_grad = node_chain(node_step(head->lhs), grad);
       break;
     case NODE_ABS:
-      lhs_grad = node_div(head, head->lhs);
+      lhs_grad = node_chain(node_sign(head->lhs), grad);
       break;
-    case NODE_RELU:
-      lhs_grad = node_div(head, head->lhs);
+    case NODE_STEP:
+    case NODE_SIGN:
+      break;
+    case NODE_SIGMOID:
+      lhs_grad =
+          node_chain(node_mul(head, node_sub(node_lit(1.0), head)), grad);
+      break;
+    case NODE_TANH:
+      lhs_grad =
+          node_chain(node_sub(node_lit(1.0), node_mul(head, head)), grad);
+      break;
+    case NODE_LOGADDEXP: // softmax of the two operands
+      lhs_grad = node_chain(node_exp(node_sub(head->lhs, head)), grad);
+      rhs_grad = node_chain(node_exp(node_sub(head->rhs, head)), grad);
       break;
     }
 
-    // int chain = head->grad->type != NODE_LIT || head->grad->val != 1.0;
-
-    if (head->lhs) {
-      lhs_grad = node_mul(lhs_grad, head->grad); // chain rule
-      head->lhs->grad = head->lhs->grad ? node_add(head->lhs->grad, lhs_grad)
-                                        : lhs_grad; // gradient accumulation
+    struct node *children[] = {head->lhs, head->rhs};
+    struct node *grads[] = {lhs_grad, rhs_grad};
+    for (int j = 0; j < 2; j++) {
+      if (grads[j] == NULL)
+        continue;
+      int pos = node_find(&index, children[j]);
+      terms[len] = (struct term){grads[j], first[pos]};
+      first[pos] = len++;
     }
-    if (head->rhs) {
-      rhs_grad = node_mul(rhs_grad, head->grad); // chain rule
-      head->rhs->grad = head->rhs->grad ? node_add(head->rhs->grad, rhs_grad)
-                                        : rhs_grad; // gradient accumulation
+  }
+
+  free(nodes), free(index.table), free(first), free(terms), free(sum);
+  timings.grad += node_clock() - start, timings.grad_calls++;
+}
+
+// helpers of `node_taylor` for power series `c` and `a` of `n` coefficients.
+// they leave `c[0]` to the caller, who computes it with the matching <math.h>
+// call so that it matches `node_eval` exactly
+
+static void series_exp(double c[], double a[], double scale, int n) {
+  // `c = exp(scale * a)`, from `c' = scale * a' * c`
+  for (int k = 1; k < n; k++) {
+    c[k] = 0.0;
+    for (int j = 1; j <= k; j++)
+      c[k] += j * a[j] * c[k - j];
+    c[k] *= scale / k;
+  }
+}
+
+static void series_log(double c[], double a[], double scale, int n) {
+  // `c = scale * log(a)`, from `a * c' = scale * a'`
+  for (int k = 1; k < n; k++) {
+    c[k] = scale * k * a[k];
+    for (int j = 1; j < k; j++)
+      c[k] -= j * c[j] * a[k - j];
+    c[k] /= k * a[0];
+  }
+}
+
+static void series_pow(double c[], double a[], double b, int n) {
+  // `c = a^b` for a constant `b`, from `a * c' = b * a' * c`
+  for (int k = 1; k < n; k++) {
+    c[k] = 0.0;
+    for (int j = 1; j <= k; j++)
+      c[k] += (b * j - (k - j)) * a[j] * c[k - j];
+    c[k] /= k * a[0];
+  }
+}
+
+static void series_riccati(double c[], double a[], double p, double q,
+                           double d[], int n) {
+  // `c` such that `c' = (p + q * c - c * c) * a'`, which covers `tanh` and
+  // the sigmoid. `d` is scratch space for the series of `p + q * c - c * c`
+  for (int k = 1; k < n; k++) {
+    d[k - 1] = (k == 1 ? p : 0.0) + q * c[k - 1];
+    for (int j = 0; j < k; j++)
+      d[k - 1] -= c[j] * c[k - 1 - j];
+    c[k] = 0.0;
+    for (int j = 1; j <= k; j++)
+      c[k] += j * a[j] * d[k - j];
+    c[k] /= k;
+  }
+}
+
+void node_taylor(struct node *node, struct node *x, double coefs[], int count,
+                 int visited) {
+  // compute the first `count` coefficients of the Taylor series of `node`,
+  // as a function of `x`, around `x->val`, and store them in `coefs`. the
+  // `k`th coefficient is the `k`th derivative divided by `k!`. every node is
+  // evaluated once on truncated power series instead of scalars, in `O(count
+  // * count)` operations, whereas differentiating `count` times with
+  // `node_grad` makes graphs that grow with every derivative. `count` must be
+  // positive. make sure all dependencies of type `NODE_LIT` hold a value.
+  // make sure to call with a unique `visited`
+
+  int len;
+  struct node **nodes = node_walk(node, &len, 0, visited);
+  struct node_index index = node_index(nodes, len);
+  double *series = malloc(sizeof *series * count * (len + 1));
+  double *tmp = series + (size_t)count * len; // scratch series
+
+  for (int i = 0; i < len; i++) {
+    struct node *head = nodes[i];
+    double *c = series + (size_t)count * i, *a = NULL, *b = NULL;
+    if (head->lhs)
+      a = series + (size_t)count * node_find(&index, head->lhs);
+    if (head->rhs)
+      b = series + (size_t)count * node_find(&index, head->rhs);
+
+    for (int k = 0; k < count; k++)
+      c[k] = 0.0;
+
+    switch (head->type) {
+    case NODE_LIT:
+      c[0] = head->val;
+      if (head == x && count > 1)
+        c[1] = 1.0;
+      break;
+    case NODE_ADD:
+      for (int k = 0; k < count; k++)
+        c[k] = a[k] + b[k];
+      break;
+    case NODE_SUB:
+      for (int k = 0; k < count; k++)
+        c[k] = a[k] - b[k];
+      break;
+    case NODE_NEG:
+      for (int k = 0; k < count; k++)
+        c[k] = -a[k];
+      break;
+    case NODE_MUL: // Cauchy product
+      for (int k = 0; k < count; k++)
+        for (int j = 0; j <= k; j++)
+          c[k] += a[j] * b[k - j];
+      break;
+    case NODE_DIV: // from `b * c = a`
+      for (int k = 0; k < count; k++) {
+        c[k] = a[k];
+        for (int j = 1; j <= k; j++)
+          c[k] -= b[j] * c[k - j];
+        c[k] /= b[0];
+      }
+      break;
+    case NODE_INV: // from `a * c = 1`
+      for (int k = 0; k < count; k++) {
+        c[k] = k ? 0.0 : 1.0;
+        for (int j = 1; j <= k; j++)
+          c[k] -= a[j] * c[k - j];
+        c[k] /= a[0];
+      }
+      break;
+    case NODE_EXP:
+      c[0] = exp(a[0]), series_exp(c, a, 1.0, count);
+      break;
+    case NODE_LOG:
+      c[0] = log(a[0]), series_log(c, a, 1.0, count);
+      break;
+    case NODE_EXP2:
+      c[0] = exp2(a[0]), series_exp(c, a, log(2.0), count);
+      break;
+    case NODE_LOG2:
+      c[0] = log2(a[0]), series_log(c, a, 1.0 / log(2.0), count);
+      break;
+    case NODE_POW:
+      c[0] = pow(a[0], b[0]);
+      int constant = 1;
+      for (int k = 1; k < count; k++)
+        constant &= b[k] == 0.0;
+      if (constant) {
+        series_pow(c, a, b[0], count);
+        break;
+      }
+      tmp[0] = log(a[0]), series_log(tmp, a, 1.0, count);
+      for (int k = count - 1; k >= 0; k--) { // `exp(b * log(a))` otherwise
+        double sum = 0.0;
+        for (int j = 0; j <= k; j++)
+          sum += b[j] * tmp[k - j];
+        tmp[k] = sum;
+      }
+      series_exp(c, tmp, 1.0, count);
+      break;
+    case NODE_SQRT:
+      c[0] = sqrt(a[0]), series_pow(c, a, 0.5, count);
+      break;
+    case NODE_CBRT:
+      c[0] = cbrt(a[0]), series_pow(c, a, 1.0 / 3.0, count);
+      break;
+    // piecewise node types take the series of whichever piece holds at
+    // `x->val`, as would the derivatives from `node_grad`
+    case NODE_MIN:
+    case NODE_MAX:
+      if (head->type == NODE_MIN ? b[0] < a[0] : b[0] > a[0])
+        a = b;
+      for (int k = 0; k < count; k++)
+        c[k] = a[k];
+      break;
+    case NODE_RELU:
+    case NODE_ABS:
+      for (int k = 0; k < count; k++)
+        c[k] = a[0] > 0.0 ? a[k] : head->type == NODE_ABS ? -a[k] : 0.0;
+      break;
+    case NODE_STEP:
+      c[0] = op_step(a[0]);
+      break;
+    case NODE_SIGN:
+      c[0] = op_sign(a[0]);
+      break;
+    case NODE_SIGMOID:
+      c[0] = op_sigmoid(a[0]), series_riccati(c, a, 0.0, 1.0, tmp, count);
+      break;
+    case NODE_TANH:
+      c[0] = op_tanh(a[0]), series_riccati(c, a, 1.0, 0.0, tmp, count);
+      break;
+    case NODE_LOGADDEXP: // `log(exp(a - m) + exp(b - m)) + m`
+      tmp[0] = exp(a[0] - fmax(a[0], b[0])), series_exp(tmp, a, 1.0, count);
+      c[0] = exp(b[0] - fmax(a[0], b[0])), series_exp(c, b, 1.0, count);
+      for (int k = 0; k < count; k++)
+        tmp[k] += c[k];
+      c[0] = op_logaddexp(a[0], b[0]), series_log(c, tmp, 1.0, count);
+      break;
     }
   }
+
+  for (int k = 0; k < count; k++)
+    coefs[k] = series[(size_t)count * (len - 1) + k];
+  free(nodes), free(index.table), free(series);
+}
+
+struct node_stats node_stats(struct node *nodes[], int count, int visited) {
+  // gather statistics about the `count` nodes of `nodes` and their
+  // dependencies. free the result with `node_stats_free`. make sure to call
+  // with a unique `visited`
+
+  struct node **order = NULL;
+  int len = 0;
+  for (int i = 0; i < count; i++) {
+    int walked;
+    struct node **walk = node_walk(nodes[i], &walked, 0, visited);
+    order = realloc(order, sizeof *order * (len + walked));
+    memcpy(order + len, walk, sizeof *order * walked), len += walked;
+    free(walk);
+  }
+
+  // borrow `id` fields to hold the position of every node in `order`, then
+  // restore them. child nodes come before their parents in `order`
+  int *ids = malloc(sizeof *ids * len), *depth = malloc(sizeof *depth * len);
+  int *fanout = calloc(len, sizeof *fanout);
+  for (int p = 0; p < len; p++)
+    ids[p] = order[p]->id, order[p]->id = p;
+
+  struct node_stats stats = {.nodes = len};
+  for (int p = 0; p < len; p++) {
+    struct node *node = order[p];
+    stats.types[node->type]++;
+    depth[p] = 0;
+    if (node->lhs && depth[node->lhs->id] + 1 > depth[p])
+      depth[p] = depth[node->lhs->id] + 1;
+    if (node->rhs && depth[node->rhs->id] + 1 > depth[p])
+      depth[p] = depth[node->rhs->id] + 1;
+    if (node->lhs)
+      fanout[node->lhs->id]++;
+    if (node->rhs)
+      fanout[node->rhs->id]++;
+    if (depth[p] + 1 > stats.depth)
+      stats.depth = depth[p] + 1;
+  }
+
+  stats.widths = calloc(stats.depth, sizeof *stats.widths);
+  for (int p = 0; p < len; p++) {
+    int bucket = 0;
+    while (bucket < NODE_FANOUTS - 1 && fanout[p] >> bucket)
+      bucket++;
+    stats.widths[depth[p]]++, stats.fanouts[bucket]++;
+    if (fanout[p] > stats.max_fanout)
+      stats.max_fanout = fanout[p];
+    order[p]->id = ids[p];
+  }
+
+  free(order), free(ids), free(depth), free(fanout);
+  return stats;
+}
+
+void node_stats_print(FILE *fp, char *name, struct node_stats *stats) {
+  // print `stats` in a human-readable form, every line prefixed by `name`
+#define NAME(UC, LC) #LC,
+  static char *names[] = {NODE_TYPES(NAME, NAME, NAME)};
+#undef NAME
+
+  fprintf(fp, "%s: %d nodes, depth %d, max fan-out %d\n", name, stats->nodes,
+          stats->depth, stats->max_fanout);
+  fprintf(fp, "%s: types", name);
+  for (int type = 0; type < NODE_TYPE_COUNT; type++)
+    if (stats->types[type])
+      fprintf(fp, " %s:%d", names[type], stats->types[type]);
+  fprintf(fp, "\n%s: widths", name);
+  for (int d = 0; d < stats->depth; d++)
+    fprintf(fp, " %d", stats->widths[d]);
+  fprintf(fp, "\n%s: fan-outs", name);
+  for (int b = 0; b < NODE_FANOUTS; b++) {
+    int lo = b ? 1 << (b - 1) : 0, hi = b ? (1 << b) - 1 : 0;
+    if (stats->fanouts[b] == 0)
+      continue;
+    if (b == NODE_FANOUTS - 1)
+      fprintf(fp, " %d+:%d", lo, stats->fanouts[b]);
+    else if (lo == hi)
+      fprintf(fp, " %d:%d", lo, stats->fanouts[b]);
+    else
+      fprintf(fp, " %d-%d:%d", lo, hi, stats->fanouts[b]);
+  }
+  fprintf(fp, "\n");
+}
+
+void node_stats_free(struct node_stats *stats) { free(stats->widths); }
+
+struct node_timings node_timings(int reset) {
+  // returns the timings summed so far, then zeroes them if `reset` is nonzero
+  struct node_timings result = timings;
+  if (reset)
+    timings = (struct node_timings){0};
+  return result;
+}
+
+void node_timings_print(FILE *fp) {
+  struct node_timings t = timings;
+  fprintf(fp, "timings: mark %.3fs in %ld calls, grad %.3fs in %ld calls\n",
+          t.mark, t.mark_calls, t.grad, t.grad_calls);
+  fprintf(fp, "timings: eval %.3fs in %ld calls, codegen %.3fs in %ld calls\n",
+          t.eval, t.eval_calls, t.codegen, t.codegen_calls);
 }
@@ -4,6 +4,8 @@
 // (see runtime.h) should be, up to partial application, either a library call
 // to <math.h> or a builtin operator, reasoning being that the set of floating-
 // point primitives provided by the C language is probably a well-balanced one.
+// the exceptions are a few fused node types, compositions of those which have
+// much cheaper derivatives or better numerical behavior than their parts.
 // clang-format off
 #define NODE_TYPES(LIT_, UNOP, BINOP)                                          \
   LIT_(LIT, lit)                                                               \
@@ -11,7 +13,9 @@
   BINOP(MUL, mul) BINOP(DIV, div) UNOP(INV, inv)                               \
   UNOP(EXP, exp) UNOP(LOG, log) UNOP(EXP2, exp2) UNOP(LOG2, log2)              \
   BINOP(POW, pow) UNOP(SQRT, sqrt) UNOP(CBRT, cbrt)                            \
-  BINOP(MIN, min) BINOP(MAX, max) UNOP(RELU, relu) UNOP(ABS, abs)
+  BINOP(MIN, min) BINOP(MAX, max) UNOP(RELU, relu) UNOP(ABS, abs)              \
+  UNOP(STEP, step) UNOP(SIGN, sign)                                            \
+  UNOP(SIGMOID, sigmoid) UNOP(TANH, tanh) BINOP(LOGADDEXP, logaddexp)
 // clang-format on
 
 struct node {
@@ -25,6 +29,10 @@ struct node {
   double val;             // for output of `node_eval`
 };
 
+#define NODE_ONE(UC, LC) +1
+enum { NODE_TYPE_COUNT = 0 NODE_TYPES(NODE_ONE, NODE_ONE, NODE_ONE) };
+#undef NODE_ONE
+
 #define DECL_LIT(UL, LC) struct node *node_##LC(double val);
 #define DECL_UNOP(UL, LC) struct node *node_##LC(struct node *lhs);
 #define DECL_BINOP(UL, LC)                                                     \
@@ -36,10 +44,55 @@ NODE_TYPES(DECL_LIT, DECL_UNOP, DECL_BINOP)
 #undef DECL_UNOP
 #undef DECL_BINOP
 
+// nodes are carved out of large blocks owned by the arena passed to
+// `arena_use`, or `malloc`ed one at a time when it is `NULL`. nodes allocated
+// from an arena must not be passed to `node_free`; release them all at once
+// with `arena_reset` or `arena_destroy` instead
+struct arena;
+
+struct arena *arena_create(int cons);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+struct arena *arena_use(struct arena *arena);
+
 int node_mark(struct node *node, struct node **head, int count, int visited);
 void node_free(struct node *head, int visited);
 void node_zerograd(struct node *head, int visited);
 void node_codegen(FILE *fp, char *decl_fmt, char *ref_fmt, struct node *node,
                   int visited);
+int node_slots(struct node *nodes[], int count, int first, int visited);
 void node_eval(struct node *node, int visited);
 void node_grad(struct node *node, int visited);
+void node_taylor(struct node *node, struct node *x, double coefs[], int count,
+                 int visited);
+struct node *node_simplify(struct node *node, int visited);
+
+// statistics about a node graph, to find out what makes generated code large
+// or slow. the depth of a node is 0 if it has no child nodes and one more than
+// the greatest depth of its child nodes otherwise. the fan-out of a node is
+// the number of times nodes of the graph refer to it as a child node
+#define NODE_FANOUTS 16 // buckets of the fan-out histogram
+
+struct node_stats {
+  int nodes;                  // number of nodes
+  int types[NODE_TYPE_COUNT]; // number of nodes of every `enum node_type`
+  int depth;                  // one more than the greatest depth of a node
+  int *widths;                // array of length `depth`; nodes of every depth
+  int fanouts[NODE_FANOUTS];  // nodes of fan-out 0, 1, 2 to 3, 4 to 7 and so
+                              // on, the last bucket holding all the rest
+  int max_fanout;             // greatest fan-out of a node
+};
+
+struct node_stats node_stats(struct node *nodes[], int count, int visited);
+void node_stats_print(FILE *fp, char *name, struct node_stats *stats);
+void node_stats_free(struct node_stats *stats);
+
+// wall-clock time spent in, and number of calls to, the phases below, summed
+// over the whole program
+struct node_timings {
+  double mark, grad, eval, codegen; // in seconds
+  long mark_calls, grad_calls, eval_calls, codegen_calls;
+};
+
+struct node_timings node_timings(int reset);
+void node_timings_print(FILE *fp);
@@ -0,0 +1,162 @@
+#define _POSIX_C_SOURCE 200809L // for `open_memstream`, `popen` and `mkdir`
+#include "autodiff.h"
+#include "tape.h"
+#include "jit.h"
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// compiler invocation, command printing the version of the compiler, cache
+// directory and path to runtime.h. paths are relative to the working directory
+// by default, so either run from the root of the repo or define them as
+// absolute paths. runtime.h is pasted into the source code rather than
+// included, so shared objects are cached under a hash of the runtime they use
+#ifndef JIT_CC
+#define JIT_CC "cc -O2 -shared -fPIC"
+#endif
+#ifndef JIT_CC_VERSION
+#define JIT_CC_VERSION "cc --version"
+#endif
+#ifndef JIT_CACHE
+#define JIT_CACHE "bin/jit/"
+#endif
+#ifndef JIT_RUNTIME
+#define JIT_RUNTIME "lib/runtime.h"
+#endif
+
+static uint64_t jit_hash(uint64_t hash, char *data, size_t len) {
+  // 64-bit FNV-1a, continuing from `hash`
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3;
+  return hash;
+}
+
+static uint64_t jit_hash_output(uint64_t hash, char *cmd) {
+  // continue `hash` over the standard output of `cmd`
+  char buf[4096];
+  size_t len;
+  FILE *fp = popen(cmd, "r");
+  if (fp == NULL)
+    perror("popen"), exit(EXIT_FAILURE);
+  while ((len = fread(buf, 1, sizeof buf, fp)) > 0)
+    hash = jit_hash(hash, buf, len);
+  if (pclose(fp) != 0)
+    fprintf(stderr, "jit: `%s` failed\n", cmd), exit(EXIT_FAILURE);
+  return hash;
+}
+
+static void jit_paste(FILE *fp, char *path) {
+  // copy the file at `path` into `fp`
+  char buf[4096];
+  size_t len;
+  FILE *in = fopen(path, "r");
+  if (in == NULL)
+    perror(path), exit(EXIT_FAILURE);
+  while ((len = fread(buf, 1, sizeof buf, in)) > 0)
+    fwrite(buf, 1, len, fp);
+  if (ferror(in) || fclose(in) == EOF)
+    perror(path), exit(EXIT_FAILURE);
+}
+
+static void jit_mkdir(void) {
+  // create `JIT_CACHE` and its missing parents. failures are left for
+  // `fopen` to report, as directories may already exist
+  char dir[] = JIT_CACHE;
+  for (char *chr = dir + 1; *chr; chr++)
+    if (*chr == '/')
+      *chr = '\0', mkdir(dir, 0777), *chr = '/';
+  mkdir(dir, 0777);
+}
+
+struct jit jit_compile(struct tape *tape, int visited) {
+  // compile `tape` into a shared object, or load it from `JIT_CACHE` if the
+  // same source code was compiled before. the `eval` function pointer of the
+  // result is valid until `jit_free`. source code is generated from the nodes
+  // of `tape`, so tapes from `tape_load` are rejected. make sure to call with
+  // a unique `visited`
+
+  if (tape->nodes == NULL)
+    fprintf(stderr, "jit: loaded tapes have no nodes to compile\n"),
+        exit(EXIT_FAILURE);
+
+  char *src;
+  size_t len;
+  FILE *fp = open_memstream(&src, &len);
+  if (fp == NULL)
+    perror("open_memstream"), exit(EXIT_FAILURE);
+
+  // borrow `id` fields to hold the index of every node, so `vals` can be
+  // indexed directly, then restore them. literals are marked visited so that
+  // `node_codegen` leaves their slots untouched, as `tape_eval` does
+  int *ids = malloc(sizeof *ids * tape->len);
+  for (int i = 0; i < tape->len; i++) {
+    struct node *node = tape->nodes[i];
+    ids[i] = node->id, node->id = i;
+    if (node->type == NODE_LIT)
+      node->visited = visited;
+  }
+
+  jit_paste(fp, JIT_RUNTIME);
+  fprintf(fp, "void jit_eval(double *v) {\n");
+  for (int i = 0; i < tape->len; i++)
+    node_codegen(fp, "v[%d] = ", "v[%d]", tape->nodes[i], visited);
+  fprintf(fp, "}\n");
+
+  for (int i = 0; i < tape->len; i++)
+    tape->nodes[i]->id = ids[i];
+  free(ids);
+
+  if (fclose(fp) == EOF)
+    perror("fclose"), exit(EXIT_FAILURE);
+
+  // over the compiler invocation, the version of the compiler and the source
+  // code, which includes runtime.h
+  uint64_t hash = jit_hash(0xcbf29ce484222325, JIT_CC, sizeof JIT_CC - 1);
+  hash = jit_hash_output(hash, JIT_CC_VERSION);
+  hash = jit_hash(hash, src, len);
+
+  char so_path[sizeof JIT_CACHE + 32];
+  snprintf(so_path, sizeof so_path, JIT_CACHE "%016llx.so",
+           (unsigned long long)hash);
+
+  if (access(so_path, F_OK) == -1) {
+    // build under names unique to this process then rename into place, so
+    // concurrent processes never load a partially written shared object
+    char src_path[sizeof so_path + 32], tmp_path[sizeof so_path + 32];
+    snprintf(src_path, sizeof src_path, "%s.%ld.c", so_path, (long)getpid());
+    snprintf(tmp_path, sizeof tmp_path, "%s.%ld", so_path, (long)getpid());
+
+    jit_mkdir();
+    FILE *src_fp = fopen(src_path, "w");
+    if (src_fp == NULL)
+      perror("fopen"), exit(EXIT_FAILURE);
+    if (fwrite(src, 1, len, src_fp) != len || fclose(src_fp) == EOF)
+      perror("fwrite"), exit(EXIT_FAILURE);
+
+    char cmd[sizeof JIT_CC + 2 * sizeof src_path + 16];
+    snprintf(cmd, sizeof cmd, JIT_CC " -o %s %s -lm", tmp_path, src_path);
+    if (system(cmd) != 0)
+      fprintf(stderr, "jit: `%s` failed\n", cmd), exit(EXIT_FAILURE);
+
+    remove(src_path);
+    if (rename(tmp_path, so_path) == -1)
+      perror("rename"), exit(EXIT_FAILURE);
+  }
+
+  free(src);
+
+  struct jit jit = {.handle = dlopen(so_path, RTLD_NOW)};
+  if (jit.handle == NULL)
+    fprintf(stderr, "dlopen: %s\n", dlerror()), exit(EXIT_FAILURE);
+  // ISO C leaves converting `void *` to a function pointer undefined, but
+  // POSIX requires this to work; see the rationale of `dlsym`
+  *(void **)&jit.eval = dlsym(jit.handle, "jit_eval");
+  if (jit.eval == NULL)
+    fprintf(stderr, "dlsym: %s\n", dlerror()), exit(EXIT_FAILURE);
+
+  return jit;
+}
+
+void jit_free(struct jit *jit) { dlclose(jit->handle); }
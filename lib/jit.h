@@ -0,0 +1,16 @@
+// a jit compiles a tape into native code at runtime, by codegenning it into C
+// source code, handing that to the system C compiler to build a shared object
+// and loading it with `dlopen`. shared objects are cached on disk under a hash
+// of their source code, runtime.h and the version of the compiler, so
+// compiling an unchanged tape again only costs a `dlopen`. the cache and
+// runtime.h are found relative to the working directory unless configured
+// otherwise; see jit.c. only tapes from `tape_compile` can be compiled, as
+// code is generated from their nodes; tapes from `tape_load` have none
+
+struct jit {
+  void *handle;               // from `dlopen`
+  void (*eval)(double *vals); // does to `vals` what `tape_eval` does
+};
+
+struct jit jit_compile(struct tape *tape, int visited);
+void jit_free(struct jit *jit);
@@ -0,0 +1,191 @@
+#define _POSIX_C_SOURCE 200809L // for `sysconf`
+#include "pool.h"
+#include <stdlib.h>
+#include <unistd.h>
+#if !defined(__STDC_NO_THREADS__) && !defined(__STDC_NO_ATOMICS__)
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <threads.h>
+#else
+#define POOL_SERIAL
+#endif
+
+#define POOL_SPIN 4096 // times idle workers yield before going to sleep
+
+#ifndef POOL_SERIAL
+struct pool_worker {
+  // chunks `top` through `bottom - 1` packed into one word as `top << 32 |
+  // bottom`, so that the owner popping from the bottom and thieves stealing
+  // from the top both claim chunks with a single compare-and-swap. aligned
+  // so that workers never share a cache line
+  alignas(64) _Atomic uint64_t range;
+  struct pool *pool;
+  thrd_t thrd;
+};
+
+struct pool {
+  int threads;
+  struct pool_worker *workers; // array of length `threads`
+
+  // the batch being run. written before `epoch` is bumped, so workers that
+  // observe the new `epoch` also observe these
+  pool_task *task; // `NULL` to make workers exit
+  void *arg;
+  int count, chunk;
+
+  _Atomic int epoch;  // bumped once per batch, under `lock`
+  _Atomic int active; // workers yet to run out of chunks in the current batch
+  mtx_t lock;         // only ever taken to go to sleep or to wake sleepers
+  cnd_t wake;
+};
+
+static int pool_claim(struct pool *pool, int self) {
+  // claim a chunk, from the bottom of the deque of worker `self` or else from
+  // the top of another's. returns -1 once every deque is empty, after which no
+  // chunk of the current batch can appear again
+  for (int i = 0; i < pool->threads; i++) {
+    int victim = (self + i) % pool->threads;
+    _Atomic uint64_t *range = &pool->workers[victim].range;
+    uint64_t old = atomic_load(range), new;
+    uint32_t top, bottom;
+    do {
+      top = old >> 32, bottom = old;
+      if (top == bottom)
+        break;
+      if (victim == self)
+        new = (uint64_t)top << 32 | (bottom - 1);
+      else
+        new = (uint64_t)(top + 1) << 32 | bottom;
+    } while (!atomic_compare_exchange_weak(range, &old, new));
+    if (top != bottom)
+      return victim == self ? bottom - 1 : top;
+  }
+  return -1;
+}
+
+static void pool_work(struct pool *pool, int self) {
+  for (int chunk; (chunk = pool_claim(pool, self)) != -1;) {
+    int begin = chunk * pool->chunk, end = begin + pool->chunk;
+    pool->task(pool->arg, self, begin, end < pool->count ? end : pool->count);
+  }
+  atomic_fetch_sub(&pool->active, 1);
+}
+
+static int pool_thrd(void *arg) {
+  struct pool_worker *worker = arg;
+  struct pool *pool = worker->pool;
+  int self = worker - pool->workers, seen = 0;
+
+  while (1) {
+    // wait for the next batch, spinning for a while in case it comes soon
+    for (int spin = 0; atomic_load(&pool->epoch) == seen; spin++) {
+      if (spin < POOL_SPIN) {
+        thrd_yield();
+        continue;
+      }
+      mtx_lock(&pool->lock);
+      while (atomic_load(&pool->epoch) == seen)
+        cnd_wait(&pool->wake, &pool->lock);
+      mtx_unlock(&pool->lock);
+    }
+    seen = atomic_load(&pool->epoch);
+
+    if (pool->task == NULL)
+      return 0;
+    pool_work(pool, self);
+  }
+}
+#else
+struct pool {
+  int threads;
+};
+#endif // POOL_SERIAL
+
+struct pool *pool_create(int threads) {
+  // create a pool of `threads` workers, the calling thread of `pool_run` being
+  // one of them, or of one worker per online processor if `threads` is 0
+  if (threads <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? online : 1;
+  }
+
+  struct pool *pool = malloc(sizeof *pool);
+#ifndef POOL_SERIAL
+  pool->threads = threads;
+  pool->workers = aligned_alloc(alignof(struct pool_worker),
+                                sizeof *pool->workers * threads);
+  pool->task = NULL;
+  atomic_init(&pool->epoch, 0), atomic_init(&pool->active, 0);
+  mtx_init(&pool->lock, mtx_plain), cnd_init(&pool->wake);
+
+  for (int i = 0; i < threads; i++) {
+    atomic_init(&pool->workers[i].range, 0);
+    pool->workers[i].pool = pool;
+    if (i && thrd_create(&pool->workers[i].thrd, pool_thrd,
+                         pool->workers + i) != thrd_success)
+      abort();
+  }
+#else
+  pool->threads = 1;
+#endif
+  return pool;
+}
+
+int pool_threads(struct pool *pool) {
+  // returns the number of workers, so the `worker` argument of tasks is
+  // always less than it
+  return pool->threads;
+}
+
+void pool_run(struct pool *pool, int count, int chunk, pool_task *task,
+              void *arg) {
+  // call `task` on every chunk of `chunk` consecutive items out of `count`,
+  // each call with the half-open range `begin` through `end` of items and the
+  // index of the worker running it. tasks with the same `worker` never run
+  // concurrently. returns once every task has returned
+
+  int chunks = (count + chunk - 1) / chunk;
+#ifndef POOL_SERIAL
+  int threads = pool->threads;
+  for (int i = 0; i < threads; i++) {
+    uint64_t top = (int64_t)chunks * i / threads,
+             bottom = (int64_t)chunks * (i + 1) / threads;
+    atomic_store(&pool->workers[i].range, top << 32 | bottom);
+  }
+  pool->task = task, pool->arg = arg;
+  pool->count = count, pool->chunk = chunk;
+  atomic_store(&pool->active, threads);
+
+  mtx_lock(&pool->lock);
+  atomic_fetch_add(&pool->epoch, 1);
+  cnd_broadcast(&pool->wake);
+  mtx_unlock(&pool->lock);
+
+  pool_work(pool, 0);
+  while (atomic_load(&pool->active))
+    thrd_yield();
+#else
+  (void)pool;
+  for (int i = 0; i < chunks; i++) {
+    int begin = i * chunk, end = begin + chunk;
+    task(arg, 0, begin, end < count ? end : count);
+  }
+#endif
+}
+
+void pool_destroy(struct pool *pool) {
+#ifndef POOL_SERIAL
+  pool->task = NULL;
+  mtx_lock(&pool->lock);
+  atomic_fetch_add(&pool->epoch, 1);
+  cnd_broadcast(&pool->wake);
+  mtx_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->threads; i++)
+    thrd_join(pool->workers[i].thrd, NULL);
+  mtx_destroy(&pool->lock), cnd_destroy(&pool->wake);
+  free(pool->workers);
+#endif
+  free(pool);
+}
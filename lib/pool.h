@@ -0,0 +1,16 @@
+// a pool runs batches of tasks on a fixed set of worker threads. the items of
+// a batch are split into chunks which are dealt out evenly onto per-worker
+// deques. workers take chunks from the bottom of their own deque and, once it
+// runs dry, steal from the top of the others', so load evens out without every
+// chunk going through a shared counter. on implementations without threads,
+// all tasks run on the calling thread
+
+struct pool;
+
+typedef void pool_task(void *arg, int worker, int begin, int end);
+
+struct pool *pool_create(int threads);
+int pool_threads(struct pool *pool);
+void pool_run(struct pool *pool, int count, int chunk, pool_task *task,
+              void *arg);
+void pool_destroy(struct pool *pool);
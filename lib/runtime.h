@@ -4,7 +4,19 @@
 
 #include <math.h>
 
-#define op_lit(LIT) LIT
+// precision of generated code. define `RUNTIME_FLOAT` before including this
+// header for single precision, which halves memory traffic and doubles the
+// number of lanes per SIMD register. literals are emitted in full and rounded
+// by `op_lit`
+#ifdef RUNTIME_FLOAT
+typedef float real_t;
+#define RUNTIME_FN(NAME) NAME##f
+#else
+typedef double real_t;
+#define RUNTIME_FN(NAME) NAME
+#endif
+
+#define op_lit(LIT) (real_t)LIT
 
 #define op_add(LHS, RHS) LHS + RHS
 #define op_sub(LHS, RHS) LHS - RHS
@@ -12,18 +24,30 @@
 
 #define op_mul(LHS, RHS) LHS *RHS
 #define op_div(LHS, RHS) LHS / RHS
-#define op_inv(LHS) 1.0 / LHS
+#define op_inv(LHS) (real_t)1.0 / LHS
+
+#define op_exp(LHS) RUNTIME_FN(exp)(LHS)
+#define op_log(LHS) RUNTIME_FN(log)(LHS)
+#define op_exp2(LHS) RUNTIME_FN(exp2)(LHS)
+#define op_log2(LHS) RUNTIME_FN(log2)(LHS)
 
-#define op_exp(LHS) exp(LHS)
-#define op_log(LHS) log(LHS)
-#define op_exp2(LHS) exp2(LHS)
-#define op_log2(LHS) log2(LHS)
+#define op_pow(LHS, RHS) RUNTIME_FN(pow)(LHS, RHS)
+#define op_sqrt(LHS) RUNTIME_FN(sqrt)(LHS)
+#define op_cbrt(LHS) RUNTIME_FN(cbrt)(LHS)
 
-#define op_pow(LHS, RHS) pow(LHS, RHS)
-#define op_sqrt(LHS) sqrt(LHS)
-#define op_cbrt(LHS) cbrt(LHS)
+#define op_min(LHS, RHS) RUNTIME_FN(fmin)(LHS, RHS)
+#define op_max(LHS, RHS) RUNTIME_FN(fmax)(LHS, RHS)
+#define op_relu(LHS) RUNTIME_FN(fmax)(LHS, 0.0)
+#define op_abs(LHS) RUNTIME_FN(fabs)(LHS)
+#define op_step(LHS) (real_t)(LHS > 0.0)
+#define op_sign(LHS) RUNTIME_FN(copysign)(1.0, LHS)
+#define op_tanh(LHS) RUNTIME_FN(tanh)(LHS)
 
-#define op_min(LHS, RHS) fmin(LHS, RHS)
-#define op_max(LHS, RHS) fmax(LHS, RHS)
-#define op_relu(LHS) fmax(LHS, 0.0)
-#define op_abs(LHS) fabs(LHS)
+// fused node types. `op_logaddexp` computes `log(exp(LHS) + exp(RHS))` without
+// overflowing for large operands. equal operands are special-cased, as their
+// difference is NaN when both are the same infinity
+#define op_sigmoid(LHS) (real_t)1.0 / ((real_t)1.0 + RUNTIME_FN(exp)(-LHS))
+#define op_logaddexp(LHS, RHS)                                                 \
+  RUNTIME_FN(fmax)(LHS, RHS) +                                                 \
+      RUNTIME_FN(log1p)(RUNTIME_FN(exp)(                                       \
+          LHS == RHS ? (real_t)0.0 : -RUNTIME_FN(fabs)(LHS - RHS)))
@@ -0,0 +1,381 @@
+#define _POSIX_C_SOURCE 200809L // for `mmap` and `open`
+#include "autodiff.h"
+#include "pool.h"
+#include "runtime.h"
+#include "tape.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAPE_GRAIN 1024 // operations per chunk when evaluating levels
+
+struct tape tape_compile(struct node *nodes[], int count, int visited) {
+  // flatten the `count` nodes of `nodes` and their dependencies into a tape.
+  // `vals` starts out holding the `val` fields of the nodes and `roots` the
+  // slots of `nodes`. make sure to call with a unique `visited`
+
+  struct node *head = NULL;
+  int len = 0;
+  for (int i = 0; i < count; i++)
+    len = node_mark(nodes[i], &head, len, visited); // reverse topological order
+
+  struct tape tape = {.len = len, .count = count};
+  tape.ops = malloc(sizeof *tape.ops * len);
+  tape.vals = malloc(sizeof *tape.vals * len);
+  tape.nodes = malloc(sizeof *tape.nodes * len);
+  tape.roots = malloc(sizeof *tape.roots * count);
+
+  // borrow `val` fields to hold the index of every node, so operands can be
+  // looked up in constant time, then restore them
+  for (int i = len; i--; head = head->next)
+    tape.nodes[i] = head, tape.vals[i] = head->val, head->val = i;
+
+  for (int i = 0; i < len; i++) {
+    struct node *node = tape.nodes[i];
+    tape.ops[i] = (struct tape_op){node->type, -1, -1};
+    if (node->lhs)
+      tape.ops[i].lhs = node->lhs->val;
+    if (node->rhs)
+      tape.ops[i].rhs = node->rhs->val;
+  }
+  for (int i = 0; i < count; i++)
+    tape.roots[i] = nodes[i]->val;
+
+  for (int i = 0; i < len; i++)
+    tape.nodes[i]->val = tape.vals[i];
+
+  return tape;
+}
+
+int tape_slot(struct tape *tape, struct node *node) {
+  // returns the index into `vals` of `node`, or -1 if `node` is not part of
+  // `tape`. takes linear time, so look slots up once ahead of time
+  for (int i = 0; i < tape->len; i++)
+    if (tape->nodes[i] == node)
+      return i;
+  return -1;
+}
+
+static inline void tape_eval_op(struct tape_op *ops, double *vals, int i) {
+  struct tape_op op = ops[i];
+  switch (op.type) {
+    // see runtime.h
+#define EVAL_LIT(UC, LC)                                                       \
+  case NODE_##UC:                                                              \
+    break;
+#define EVAL_UNOP(UC, LC)                                                      \
+  case NODE_##UC:                                                              \
+    vals[i] = op_##LC(vals[op.lhs]);                                           \
+    break;
+#define EVAL_BINOP(UC, LC)                                                     \
+  case NODE_##UC:                                                              \
+    vals[i] = op_##LC(vals[op.lhs], vals[op.rhs]);                             \
+    break;
+
+    NODE_TYPES(EVAL_LIT, EVAL_UNOP, EVAL_BINOP)
+
+#undef EVAL_LIT
+#undef EVAL_UNOP
+#undef EVAL_BINOP
+  }
+}
+
+void tape_eval(struct tape *tape) {
+  // evaluate every operation of `tape` and store results in `vals`. slots of
+  // operations of type `NODE_LIT` are left untouched, so assign to them to
+  // set inputs
+  for (int i = 0; i < tape->len; i++)
+    tape_eval_op(tape->ops, tape->vals, i);
+}
+
+struct tape_levels tape_levelize(struct tape *tape) {
+  // group the operations of `tape` into levels, level `l` holding operations
+  // whose longest chain of non-literal dependencies has length `l`. takes
+  // linear time; levelize once and evaluate many times
+  int *level = malloc(sizeof *level * tape->len);
+  struct tape_levels levels = {0};
+  for (int i = 0; i < tape->len; i++) {
+    struct tape_op op = tape->ops[i];
+    level[i] = -1;
+    if (op.type == NODE_LIT)
+      continue;
+    level[i] = op.lhs < 0 ? 0 : level[op.lhs] + 1;
+    if (op.rhs >= 0 && level[op.rhs] + 1 > level[i])
+      level[i] = level[op.rhs] + 1;
+    if (level[i] + 1 > levels.count)
+      levels.count = level[i] + 1;
+  }
+
+  // counting sort by level, so slots within a level stay in ascending order
+  levels.starts = calloc(levels.count + 1, sizeof *levels.starts);
+  for (int i = 0; i < tape->len; i++)
+    if (level[i] >= 0)
+      levels.starts[level[i] + 1]++;
+  for (int l = 0; l < levels.count; l++)
+    levels.starts[l + 1] += levels.starts[l];
+  levels.order = malloc(sizeof *levels.order * levels.starts[levels.count]);
+  int *next = malloc(sizeof *next * levels.count);
+  for (int l = 0; l < levels.count; l++)
+    next[l] = levels.starts[l];
+  for (int i = 0; i < tape->len; i++)
+    if (level[i] >= 0)
+      levels.order[next[level[i]]++] = i;
+
+  free(level), free(next);
+  return levels;
+}
+
+struct tape_level_task {
+  struct tape_op *ops;
+  double *vals;
+  int *slots; // operations of the level being evaluated
+};
+
+static void tape_level_task(void *arg, int worker, int begin, int end) {
+  (void)worker;
+  struct tape_level_task *t = arg;
+  for (int i = begin; i < end; i++)
+    tape_eval_op(t->ops, t->vals, t->slots[i]);
+}
+
+void tape_eval_levels(struct tape *tape, struct tape_levels *levels,
+                      struct pool *pool) {
+  // like `tape_eval`, but evaluates every level of `levels`, from
+  // `tape_levelize`, across the workers of `pool`. levels narrower than
+  // `TAPE_GRAIN` operations are not worth waking workers up for, so they run
+  // on the calling thread
+  struct tape_level_task task = {tape->ops, tape->vals, NULL};
+  for (int l = 0; l < levels->count; l++) {
+    int begin = levels->starts[l], width = levels->starts[l + 1] - begin;
+    task.slots = levels->order + begin;
+    if (width <= TAPE_GRAIN)
+      tape_level_task(&task, 0, 0, width);
+    else
+      pool_run(pool, width, TAPE_GRAIN, tape_level_task, &task);
+  }
+}
+
+void tape_levels_free(struct tape_levels *levels) {
+  free(levels->order), free(levels->starts);
+}
+
+double *tape_lanes(struct tape *tape, int width) {
+  // allocate values for `tape_eval_lanes`, every lane a copy of `vals`
+  double *lanes = malloc(sizeof *lanes * tape->len * width);
+  for (int i = 0; i < tape->len; i++)
+    for (int l = 0; l < width; l++)
+      lanes[i * width + l] = tape->vals[i];
+  return lanes;
+}
+
+void tape_eval_lanes(struct tape *tape, double *lanes, int width) {
+  // like `tape_eval`, but evaluates `width` independent lanes of values in a
+  // single pass over `ops`, lane `l` of slot `i` being `lanes[i * width + l]`.
+  // each operation is a loop over a lane, which compilers can vectorize
+
+  struct tape_op *ops = tape->ops;
+
+  for (int i = 0; i < tape->len; i++) {
+    struct tape_op op = ops[i];
+    double *restrict out = lanes + (size_t)i * width;
+    double *restrict lhs = op.lhs < 0 ? NULL : lanes + (size_t)op.lhs * width;
+    double *restrict rhs = op.rhs < 0 ? NULL : lanes + (size_t)op.rhs * width;
+    switch (op.type) {
+      // see runtime.h
+#define EVAL_LIT(UC, LC)                                                       \
+  case NODE_##UC:                                                              \
+    break;
+#define EVAL_UNOP(UC, LC)                                                      \
+  case NODE_##UC:                                                              \
+    for (int l = 0; l < width; l++)                                            \
+      out[l] = op_##LC(lhs[l]);                                                \
+    break;
+#define EVAL_BINOP(UC, LC)                                                     \
+  case NODE_##UC:                                                              \
+    for (int l = 0; l < width; l++)                                            \
+      out[l] = op_##LC(lhs[l], rhs[l]);                                        \
+    break;
+
+      NODE_TYPES(EVAL_LIT, EVAL_UNOP, EVAL_BINOP)
+
+#undef EVAL_LIT
+#undef EVAL_UNOP
+#undef EVAL_BINOP
+    }
+  }
+}
+
+void tape_codegen(FILE *fp, char *name, char *width, struct tape *tape) {
+  // codegen `tape` into C source code, as a function `static void name(real_t
+  // (*vals)[width])` doing what `tape_eval_lanes` does, with `ops` baked into
+  // a static table and helpers named `name` followed by node type names. a
+  // table keeps the generated function small no matter the size of `tape`,
+  // where straight-line code with a loop per operation would make C compilers
+  // choke. slots of `node_lit(NAN)`s are left untouched so
+  // they can be used as inputs, but other literals are assigned their value.
+  // unused operands refer to slot 0 so operands can be fetched unconditionally
+
+  fprintf(fp, "static const struct { int type, lhs, rhs; real_t val; } ");
+  fprintf(fp, "%s_ops[%d] = {\n", name, tape->len);
+  for (int i = 0; i < tape->len; i++) {
+    struct tape_op op = tape->ops[i];
+    double val = tape->vals[i];
+    if (op.type != NODE_LIT)
+      fprintf(fp, "{%d, %d, %d, 0},\n", op.type, op.lhs < 0 ? 0 : op.lhs,
+              op.rhs < 0 ? 0 : op.rhs);
+    else if (isinf(val))
+      fprintf(fp, "{%d, 0, 0, %sHUGE_VAL},\n", op.type, val < 0 ? "-" : "");
+    else if (!isnan(val))
+      fprintf(fp, "{%d, 0, 0, %#a},\n", op.type, val); // see `node_emit`
+    else
+      fprintf(fp, "{-1, 0, 0, 0},\n");
+  }
+  fprintf(fp, "};\n\n");
+
+  // one function per node type, so operands can be `restrict`-qualified
+  // parameters, which is what compilers need to vectorize loops over lanes.
+  // see runtime.h
+#define GEN_LIT(UC, LC)                                                        \
+  fprintf(fp, "static void %s_" #LC "(real_t *restrict out, real_t val) {\n",  \
+          name);                                                               \
+  fprintf(fp, "for (int l = 0; l < %s; l++)\n", width);                        \
+  fprintf(fp, "out[l] = op_" #LC "(val);\n}\n\n");
+#define GEN_UNOP(UC, LC)                                                       \
+  fprintf(fp, "static void %s_" #LC "(real_t *restrict out, ", name);          \
+  fprintf(fp, "real_t *restrict lhs) {\n");                                    \
+  fprintf(fp, "for (int l = 0; l < %s; l++)\n", width);                        \
+  fprintf(fp, "out[l] = op_" #LC "(lhs[l]);\n}\n\n");
+#define GEN_BINOP(UC, LC)                                                      \
+  fprintf(fp, "static void %s_" #LC "(real_t *restrict out, ", name);          \
+  fprintf(fp, "real_t *restrict lhs, real_t *restrict rhs) {\n");              \
+  fprintf(fp, "for (int l = 0; l < %s; l++)\n", width);                        \
+  fprintf(fp, "out[l] = op_" #LC "(lhs[l], rhs[l]);\n}\n\n");
+
+  NODE_TYPES(GEN_LIT, GEN_UNOP, GEN_BINOP)
+
+#undef GEN_LIT
+#undef GEN_UNOP
+#undef GEN_BINOP
+
+  fprintf(fp, "static void %s(real_t (*vals)[%s]) {\n", name, width);
+  fprintf(fp, "for (int i = 0; i < %d; i++) {\n", tape->len);
+  fprintf(fp, "real_t *lhs = vals[%s_ops[i].lhs], ", name);
+  fprintf(fp, "*rhs = vals[%s_ops[i].rhs];\n", name);
+  fprintf(fp, "switch (%s_ops[i].type) {\n", name);
+  fprintf(fp, "case -1:\nbreak;\n");
+
+#define GEN_LIT(UC, LC)                                                        \
+  fprintf(fp, "case %d:\n%s_" #LC "(vals[i], %s_ops[i].val);\nbreak;\n",       \
+          NODE_##UC, name, name);
+#define GEN_UNOP(UC, LC)                                                       \
+  fprintf(fp, "case %d:\n%s_" #LC "(vals[i], lhs);\nbreak;\n", NODE_##UC,      \
+          name);
+#define GEN_BINOP(UC, LC)                                                      \
+  fprintf(fp, "case %d:\n%s_" #LC "(vals[i], lhs, rhs);\nbreak;\n",            \
+          NODE_##UC, name);
+
+  NODE_TYPES(GEN_LIT, GEN_UNOP, GEN_BINOP)
+
+#undef GEN_LIT
+#undef GEN_UNOP
+#undef GEN_BINOP
+
+  fprintf(fp, "}\n");
+  fprintf(fp, "}\n");
+  fprintf(fp, "}\n");
+}
+
+// on-disk layout of a tape, in native byte order: a header, then `vals`, `ops`
+// and `roots` back to back. `vals` comes first so every array is aligned
+struct tape_header {
+  char magic[8]; // `TAPE_MAGIC`
+  int32_t len, count;
+};
+
+#define TAPE_MAGIC "tape\0\0\0\1"
+
+void tape_save(struct tape *tape, char *path) {
+  // write `tape` to the file at `path`, to be loaded back with `tape_load`.
+  // `nodes` is not saved
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL)
+    perror("fopen"), exit(EXIT_FAILURE);
+
+  struct tape_header header = {TAPE_MAGIC, tape->len, tape->count};
+  size_t len = tape->len, count = tape->count;
+  if (fwrite(&header, sizeof header, 1, fp) != 1 ||
+      fwrite(tape->vals, sizeof *tape->vals, len, fp) != len ||
+      fwrite(tape->ops, sizeof *tape->ops, len, fp) != len ||
+      fwrite(tape->roots, sizeof *tape->roots, count, fp) != count)
+    perror("fwrite"), exit(EXIT_FAILURE);
+
+  if (fclose(fp) == EOF)
+    perror("fclose"), exit(EXIT_FAILURE);
+}
+
+struct tape tape_load(char *path) {
+  // map the file at `path` written by `tape_save` into memory, so loading
+  // copies nothing and builds no node. operations and roots are validated in
+  // a single pass, so evaluating a corrupt tape never indexes out of bounds.
+  // the mapping is private, so `vals` can be written to without modifying
+  // the file. `nodes` is `NULL`, so `tape_slot` cannot be used; look slots up
+  // in `roots` instead
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    perror("open"), exit(EXIT_FAILURE);
+
+  size_t size = st.st_size;
+  if (size < sizeof(struct tape_header))
+    fprintf(stderr, "%s: not a tape\n", path), exit(EXIT_FAILURE);
+  struct tape_header *header =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (header == MAP_FAILED || close(fd) == -1)
+    perror("mmap"), exit(EXIT_FAILURE);
+
+  struct tape tape = {.len = header->len, .count = header->count};
+  if (memcmp(header->magic, TAPE_MAGIC, sizeof header->magic) != 0 ||
+      tape.len < 0 || tape.count < 0 ||
+      size != sizeof *header +
+                  tape.len * (sizeof *tape.vals + sizeof *tape.ops) +
+                  tape.count * sizeof *tape.roots)
+    fprintf(stderr, "%s: not a tape\n", path), exit(EXIT_FAILURE);
+
+  tape.vals = (double *)(header + 1);
+  tape.ops = (struct tape_op *)(tape.vals + tape.len);
+  tape.roots = (int *)(tape.ops + tape.len);
+  tape.size = size;
+
+  // operands refer to earlier operations, as in `tape_compile`, and exactly
+  // those of the arity of the type of the operation are used
+#define ARITY_LIT(UC, LC) 0,
+#define ARITY_UNOP(UC, LC) 1,
+#define ARITY_BINOP(UC, LC) 2,
+  static const int arity[] = {NODE_TYPES(ARITY_LIT, ARITY_UNOP, ARITY_BINOP)};
+#undef ARITY_LIT
+#undef ARITY_UNOP
+#undef ARITY_BINOP
+  for (int i = 0; i < tape.len; i++) {
+    struct tape_op op = tape.ops[i];
+    if (op.type < 0 || op.type >= (int)(sizeof arity / sizeof *arity) ||
+        (arity[op.type] >= 1 ? op.lhs < 0 || op.lhs >= i : op.lhs != -1) ||
+        (arity[op.type] >= 2 ? op.rhs < 0 || op.rhs >= i : op.rhs != -1))
+      fprintf(stderr, "%s: bad operation %d\n", path, i), exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < tape.count; i++)
+    if (tape.roots[i] < 0 || tape.roots[i] >= tape.len)
+      fprintf(stderr, "%s: bad root %d\n", path, i), exit(EXIT_FAILURE);
+
+  return tape;
+}
+
+void tape_free(struct tape *tape) {
+  if (tape->size) // loaded by `tape_load`
+    munmap((struct tape_header *)tape->vals - 1, tape->size);
+  else
+    free(tape->ops), free(tape->vals), free(tape->nodes), free(tape->roots);
+}
@@ -0,0 +1,48 @@
+// a tape is a node graph flattened into an array of operations in topological
+// order, whose operands are indices into a dense array of values. evaluating
+// a tape only ever walks these two arrays sequentially, and does not touch the
+// `struct node`s it was compiled from. tapes can be saved to disk and mapped
+// back into memory, so a built graph can be reused without rebuilding it.
+// wide tapes can also be evaluated level by level across a thread pool
+
+struct tape_op {
+  int type;     // an `enum node_type`
+  int lhs, rhs; // indices of operands into `vals`; -1 if unused
+};
+
+struct tape {
+  int len;             // number of operations
+  struct tape_op *ops; // array of length `len`, in topological order
+  double *vals;        // array of length `len`; see `tape_eval`
+  struct node **nodes; // array of length `len`; nodes `ops` are compiled from
+  int count;           // number of nodes passed to `tape_compile`
+  int *roots;          // array of length `count`; slots of those nodes
+  size_t size;         // size of the mapping if loaded, or 0; see `tape_load`
+};
+
+// the operations of a tape grouped into levels, every operation depending
+// only on operations of earlier levels, so operations of a level can run in
+// any order or concurrently. literals are left out, as evaluating them is a
+// no-op
+struct tape_levels {
+  int count;   // number of levels
+  int *order;  // slots of operations, level by level
+  int *starts; // array of length `count + 1`; level `l` is `order[starts[l]]`
+               // through `order[starts[l + 1] - 1]`
+};
+
+struct pool;
+
+struct tape tape_compile(struct node *nodes[], int count, int visited);
+int tape_slot(struct tape *tape, struct node *node);
+void tape_eval(struct tape *tape);
+struct tape_levels tape_levelize(struct tape *tape);
+void tape_eval_levels(struct tape *tape, struct tape_levels *levels,
+                      struct pool *pool);
+void tape_levels_free(struct tape_levels *levels);
+double *tape_lanes(struct tape *tape, int width);
+void tape_eval_lanes(struct tape *tape, double *lanes, int width);
+void tape_codegen(FILE *fp, char *name, char *width, struct tape *tape);
+void tape_save(struct tape *tape, char *path);
+struct tape tape_load(char *path);
+void tape_free(struct tape *tape);
@@ -24,9 +24,38 @@ int shape_cmp(size_t *lhs, size_t *rhs) {
   return *lhs - *rhs;
 }
 
+static void shape_strides(size_t *shape, size_t *strides) {
+  // strides of a dense row-major tensor of shape `shape`
+  size_t rank = shape_rank(shape), stride = 1;
+  memset(strides, 0, sizeof(shape_t));
+  while (rank--)
+    strides[rank] = stride, stride *= shape[rank];
+}
+
+static bool tensor_contiguous(struct tensor *tensor) {
+  // whether the elements of `tensor` are consecutive in row-major order
+  size_t rank = shape_rank(tensor->shape), stride = 1;
+  while (rank--) {
+    if (tensor->shape[rank] != 1 && tensor->strides[rank] != stride)
+      return false;
+    stride *= tensor->shape[rank];
+  }
+  return true;
+}
+
+struct node **tensor_at(struct tensor *tensor, size_t idx) {
+  // returns a pointer to the element of index `idx` in row-major order
+  size_t pos = tensor->offset;
+  for (size_t rank = shape_rank(tensor->shape); rank--;)
+    pos += idx % tensor->shape[rank] * tensor->strides[rank],
+        idx /= tensor->shape[rank];
+  return tensor->data + pos;
+}
+
 struct tensor tensor_alloc(shape_t shape) {
-  struct tensor tensor;
+  struct tensor tensor = {.offset = 0};
   memcpy(tensor.shape, shape, sizeof tensor.shape);
+  shape_strides(tensor.shape, tensor.strides);
   tensor.data = calloc(shape_size(shape), sizeof *tensor.data);
   return tensor;
 }
@@ -47,16 +76,16 @@ struct tensor tensor_clone(bool move_tensor, struct tensor tensor) {
   if (move_tensor)
     return tensor;
 
+  // copies the elements of a view into a dense tensor of its own
   struct tensor clone = tensor_alloc(tensor.shape);
-  memcpy(clone.shape, tensor.shape, sizeof clone.shape);
-  memcpy(clone.data, tensor.data, shape_size(clone.shape));
+  TENSOR_FOR(clone) node = *tensor_at(&tensor, idx);
   return clone;
 }
 
 struct tensor tensor_unop(struct node *(*unop)(struct node *lhs), bool move_lhs,
                           struct tensor lhs) {
   struct tensor out = move_lhs ? lhs : tensor_alloc(lhs.shape);
-  TENSOR_FOR(out) node = unop(lhs.data[idx]);
+  TENSOR_FOR(out) node = unop(*tensor_at(&lhs, idx));
   return out;
 }
 
@@ -68,7 +97,7 @@ struct tensor tensor_binop(struct node *(*binop)(struct node *lhs,
     abort();
 
   struct tensor out = move_lhs ? lhs : move_rhs ? rhs : tensor_alloc(lhs.shape);
-  TENSOR_FOR(out) node = binop(lhs.data[idx], rhs.data[idx]);
+  TENSOR_FOR(out) node = binop(*tensor_at(&lhs, idx), *tensor_at(&rhs, idx));
   if (move_lhs && move_rhs)
     free(rhs.data);
   return out;
@@ -85,10 +114,37 @@ struct node *tensor_fold(struct node *id,
   return acc;
 }
 
+struct node *tensor_reduce(struct node *(*binop)(struct node *lhs,
+                                                 struct node *rhs),
+                           bool move_tensor, struct tensor tensor) {
+  // like `tensor_fold`, but combines neighboring elements pairwise in a
+  // balanced tree, so the result has logarithmic rather than linear depth and
+  // rounding errors grow more slowly. `binop` must be associative. shapes are
+  // never empty, so no identity is needed
+
+  size_t size = shape_size(tensor.shape);
+  struct node **nodes = malloc(sizeof *nodes * size);
+  TENSOR_FOR(tensor) nodes[idx] = node;
+  if (move_tensor)
+    free(tensor.data);
+
+  for (; size > 1; size = (size + 1) / 2) {
+    for (size_t i = 0; i < size / 2; i++)
+      nodes[i] = binop(nodes[2 * i], nodes[2 * i + 1]);
+    if (size % 2)
+      nodes[size / 2] = nodes[size - 1];
+  }
+
+  struct node *acc = nodes[0];
+  free(nodes);
+  return acc;
+}
+
 struct tensor tensor_matmul(bool move_lhs, struct tensor lhs, bool move_rhs,
                             struct tensor rhs) {
   // perform matrix multiplication on the two outermost dimensions, operating
-  // element-wise on inner dimensions
+  // element-wise on inner dimensions. products are summed in a balanced tree,
+  // as in `tensor_reduce`
 
   if (shape_rank(lhs.shape) < 2 || shape_rank(rhs.shape) < 2)
     abort();
@@ -99,23 +155,30 @@ struct tensor tensor_matmul(bool move_lhs, struct tensor lhs, bool move_rhs,
 
   shape_t shape = {lhs.shape[0]};
   memcpy(shape + 1, rhs.shape + 1, sizeof rhs.shape - sizeof *rhs.shape);
-  struct tensor out = tensor_repeat(shape, node_lit(0.0));
+  struct tensor out = tensor_alloc(shape);
+  struct tensor *terms = malloc(sizeof *terms * lhs.shape[1]);
 
   for (size_t i = 0; i < lhs.shape[0]; i++) {
     for (size_t k = 0; k < rhs.shape[1]; k++) {
-      struct tensor out_slice = tensor_slice(REF tensor_slice(REF out, i), k);
-      for (size_t j = 0; j < lhs.shape[1]; j++) {
-        struct tensor mul_lhs_rhs = tensor_binop(
-            node_mul, REF tensor_slice(REF tensor_slice(REF lhs, i), j),
-            REF tensor_slice(REF tensor_slice(REF rhs, j), k));
-        struct tensor ret =
-            tensor_binop(node_add, MOVE out_slice, MOVE mul_lhs_rhs);
-        if (ret.data != out_slice.data) // hehe
-          abort();
+      struct tensor out_slice = tensor_slice(tensor_slice(out, i), k);
+      for (size_t j = 0; j < lhs.shape[1]; j++)
+        terms[j] = tensor_binop(
+            node_mul, REF tensor_slice(tensor_slice(lhs, i), j),
+            REF tensor_slice(tensor_slice(rhs, j), k));
+      for (size_t size = lhs.shape[1]; size > 1; size = (size + 1) / 2) {
+        for (size_t j = 0; j < size / 2; j++)
+          terms[j] = tensor_binop(node_add, MOVE terms[2 * j],
+                                  MOVE terms[2 * j + 1]);
+        if (size % 2)
+          terms[size / 2] = terms[size - 1];
       }
+      TENSOR_FOR(out_slice) node = *tensor_at(terms, idx);
+      free(terms->data);
     }
   }
 
+  free(terms);
+
   if (move_lhs)
     free(lhs.data);
   if (move_rhs)
@@ -127,34 +190,77 @@ struct tensor tensor_matmul(bool move_lhs, struct tensor lhs, bool move_rhs,
 struct tensor tensor_reshape(shape_t shape, bool move_tensor,
                              struct tensor tensor) {
   // if `tensor` is lent, returns a borrowed tensor of the same lifetime. if
-  // `tensor` is moved in, returns an owned tensor
+  // `tensor` is moved in, returns an owned tensor. views whose elements are
+  // not consecutive, such as transposes, are copied if moved in and must be
+  // cloned beforehand otherwise
 
   if (shape_size(tensor.shape) != shape_size(shape))
     abort();
 
-  (void)move_tensor;
+  if (!tensor_contiguous(&tensor)) {
+    if (!move_tensor)
+      abort();
+    struct tensor clone = tensor_clone(REF tensor);
+    free(tensor.data);
+    tensor = clone;
+  }
   memcpy(tensor.shape, shape, sizeof tensor.shape);
+  shape_strides(tensor.shape, tensor.strides);
   return tensor;
 }
 
-struct tensor tensor_slice(bool move_tensor, struct tensor tensor, size_t idx) {
-  // `tensor` must be lent. returns a borrowed tensor of the same lifetime
+struct tensor tensor_transpose(struct tensor tensor, size_t lhs_axis,
+                               size_t rhs_axis) {
+  // swaps two dimensions of `tensor`, without copying. the view shares `data`
+  // with `tensor`, so it is owned if `tensor` is and borrowed otherwise
+
+  size_t rank = shape_rank(tensor.shape);
+  if (lhs_axis >= rank || rhs_axis >= rank)
+    abort();
+
+  size_t *fields[] = {tensor.shape, tensor.strides};
+  for (int i = 0; i < 2; i++) {
+    size_t tmp = fields[i][lhs_axis];
+    fields[i][lhs_axis] = fields[i][rhs_axis], fields[i][rhs_axis] = tmp;
+  }
+  return tensor;
+}
+
+struct tensor tensor_slice(struct tensor tensor, size_t idx) {
+  // index the outermost dimension of `tensor`, without copying. has the
+  // ownership semantics of `tensor_transpose`
 
   if (idx >= *tensor.shape)
     abort();
-  if (move_tensor)
+
+  tensor.offset += idx * *tensor.strides;
+  memmove(tensor.shape, tensor.shape + 1,
+          sizeof tensor.shape - sizeof *tensor.shape);
+  memmove(tensor.strides, tensor.strides + 1,
+          sizeof tensor.strides - sizeof *tensor.strides);
+  tensor.shape[sizeof tensor.shape / sizeof *tensor.shape - 1] = 0;
+  return tensor;
+}
+
+struct tensor tensor_narrow(struct tensor tensor, size_t axis, size_t begin,
+                            size_t end) {
+  // restrict dimension `axis` of `tensor` to indices `begin` through `end -
+  // 1`, without copying. has the ownership semantics of `tensor_transpose`
+
+  if (axis >= shape_rank(tensor.shape) || begin >= end ||
+      end > tensor.shape[axis])
     abort();
 
-  struct tensor slice = {0};
-  memcpy(slice.shape, tensor.shape + 1,
-         sizeof tensor.shape - sizeof *tensor.shape);
-  slice.data = tensor.data + idx * shape_size(slice.shape);
-  return slice;
+  tensor.offset += begin * tensor.strides[axis];
+  tensor.shape[axis] = end - begin;
+  return tensor;
 }
 
 struct tensor tensor_subscript(bool move_tensor, struct tensor tensor,
                                size_t idx) {
-  struct tensor subscript = tensor_clone(REF tensor_slice(REF tensor, idx));
+  // like `tensor_slice`, but returns an owned copy. a view of a moved-in
+  // `tensor` would keep all of its allocation alive for the sake of one slice
+  struct tensor subscript = tensor_clone(REF tensor_slice(tensor, idx));
   if (move_tensor)
     free(tensor.data);
   return subscript;
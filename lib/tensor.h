@@ -7,21 +7,34 @@
 #define MOVE true,
 #define REF false,
 
+// iterates over the elements of a tensor in row-major order, as `node`, which
+// can be assigned to. `TENSOR` must be an lvalue
 #define TENSOR_FOR(TENSOR)                                                     \
   for (size_t idx = 0; idx < shape_size((TENSOR).shape); idx++)                \
-    for (struct node *node = (TENSOR).data[idx], **_p = &node; _p;             \
-         (TENSOR).data[idx] = node, _p = NULL)
+    for (struct node **_at = tensor_at(&(TENSOR), idx), *node = *_at,          \
+                     **_p = &node;                                             \
+         _p; *_at = node, _p = NULL)
 
 typedef size_t shape_t[16];
 
+// a tensor is a strided view into `data`, so transposing, slicing and
+// reshaping only compute a new `shape`, `strides` and `offset`. `data` always
+// points to the start of its allocation, so views of an owned tensor are
+// owned and views of a borrowed tensor are borrowed, with the same lifetime.
+// `tensor_transpose`, `tensor_slice` and `tensor_narrow` therefore take no
+// `move...` parameter
 struct tensor {
   shape_t shape;      // must be null terminated
-  struct node **data; // array of length `shape_size(shape)`
+  shape_t strides;    // distance in `data` between consecutive indices along
+                      // every dimension of `shape`
+  size_t offset;      // position in `data` of the first element
+  struct node **data; // allocation holding the elements
 };
 
 size_t shape_size(size_t *shape);
 size_t shape_rank(size_t *shape);
 int shape_cmp(size_t *lhs, size_t *rhs);
+struct node **tensor_at(struct tensor *tensor, size_t idx);
 struct tensor tensor_alloc(shape_t shape);
 struct tensor tensor_nans(shape_t shape);
 struct tensor tensor_repeat(shape_t shape, struct node *item);
@@ -36,11 +49,18 @@ struct node *tensor_fold(struct node *id,
                          struct node *(*binop)(struct node *lhs,
                                                struct node *rhs),
                          bool move_tensor, struct tensor tensor);
+struct node *tensor_reduce(struct node *(*binop)(struct node *lhs,
+                                                 struct node *rhs),
+                           bool move_tensor, struct tensor tensor);
 struct tensor tensor_matmul(bool move_lhs, struct tensor lhs, bool move_rhs,
                             struct tensor rhs);
 struct tensor tensor_reshape(shape_t shape, bool move_tensor,
                              struct tensor tensor);
-struct tensor tensor_slice(bool move_tensor, struct tensor tensor, size_t idx);
+struct tensor tensor_transpose(struct tensor tensor, size_t lhs_axis,
+                               size_t rhs_axis);
+struct tensor tensor_slice(struct tensor tensor, size_t idx);
+struct tensor tensor_narrow(struct tensor tensor, size_t axis, size_t begin,
+                            size_t end);
 struct tensor tensor_subscript(bool move_tensor, struct tensor tensor,
                                size_t idx);
 struct tensor tensor_collect(bool move_tensors[], struct tensor tensors[]);
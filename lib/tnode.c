@@ -0,0 +1,411 @@
+#include "autodiff.h"
+#include "tensor.h"
+#include "tnode.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int tnode_id = 0;
+
+static struct tnode *tnode_new(enum tnode_type type, shape_t shape) {
+  struct tnode *tnode = malloc(sizeof *tnode);
+  *tnode = (struct tnode){.type = type, .id = tnode_id++};
+  memcpy(tnode->shape, shape, sizeof tnode->shape);
+  return tnode;
+}
+
+struct tnode *tnode_input(shape_t shape) {
+  return tnode_new(TNODE_INPUT, shape);
+}
+
+// bodies are allocated on the heap and never hash-consed, so that no two
+// tnodes share a `struct node`. `tnode_codegen` relies on this to codegen
+// every body in full within its own loop
+
+struct tnode *tnode_lit(shape_t shape, double val) {
+  struct tnode *tnode = tnode_new(TNODE_EWISE, shape);
+  struct arena *arena = arena_use(NULL);
+  tnode->body = node_lit(val);
+  arena_use(arena);
+  return tnode;
+}
+
+struct tnode *tnode_unop(struct node *(*unop)(struct node *lhs),
+                         struct tnode *lhs) {
+  struct tnode *tnode = tnode_new(TNODE_EWISE, lhs->shape);
+  struct arena *arena = arena_use(NULL);
+  tnode->args[0] = lhs, tnode->params[0] = node_lit(NAN);
+  tnode->body = unop(tnode->params[0]);
+  arena_use(arena);
+  return tnode;
+}
+
+struct tnode *tnode_binop(struct node *(*binop)(struct node *lhs,
+                                                struct node *rhs),
+                          struct tnode *lhs, struct tnode *rhs) {
+  if (shape_cmp(lhs->shape, rhs->shape) != 0)
+    abort();
+
+  struct tnode *tnode = tnode_new(TNODE_EWISE, lhs->shape);
+  struct arena *arena = arena_use(NULL);
+  tnode->args[0] = lhs, tnode->params[0] = node_lit(NAN);
+  tnode->args[1] = rhs, tnode->params[1] = node_lit(NAN);
+  tnode->body = binop(tnode->params[0], tnode->params[1]);
+  arena_use(arena);
+  return tnode;
+}
+
+static struct tnode *tnode_gemm(struct tnode *lhs, int trans_lhs,
+                                struct tnode *rhs, int trans_rhs) {
+  // matrix product of `lhs` and `rhs`, either of which may be transposed
+  size_t *l = lhs->shape, *r = rhs->shape;
+  if (shape_rank(l) != 2 || shape_rank(r) != 2)
+    abort();
+  if (l[!trans_lhs] != r[trans_rhs])
+    abort();
+
+  struct tnode *tnode =
+      tnode_new(TNODE_MATMUL, (shape_t){l[trans_lhs], r[!trans_rhs]});
+  tnode->args[0] = lhs, tnode->trans[0] = trans_lhs;
+  tnode->args[1] = rhs, tnode->trans[1] = trans_rhs;
+  return tnode;
+}
+
+struct tnode *tnode_matmul(struct tnode *lhs, struct tnode *rhs) {
+  return tnode_gemm(lhs, 0, rhs, 0);
+}
+
+struct tnode *tnode_sum(struct tnode *tnode) {
+  struct tnode *sum = tnode_new(TNODE_SUM, (shape_t){1});
+  sum->args[0] = tnode;
+  return sum;
+}
+
+struct tnode *tnode_logsumexp(struct tnode *tnode) {
+  struct tnode *lse = tnode_new(TNODE_LOGSUMEXP, (shape_t){1});
+  lse->args[0] = tnode;
+  return lse;
+}
+
+struct tnode *tnode_repeat(shape_t shape, struct tnode *item) {
+  if (shape_size(item->shape) != 1)
+    abort();
+
+  struct tnode *tnode = tnode_new(TNODE_REPEAT, shape);
+  tnode->args[0] = item;
+  return tnode;
+}
+
+static struct tnode **tnode_walk(struct tnode *tnode, int *count,
+                                 int visited) {
+  // mark `tnode` and its dependencies as `visited` and return an array of the
+  // newly marked tnodes in topological order, `args` visited in order. stores
+  // their number in `*count`. uses an explicit stack rather than recursion,
+  // so that deep graphs cannot overflow the C stack
+
+  struct frame {
+    struct tnode *tnode;
+    int expanded; // whether the operands of `tnode` were pushed already
+  } stack_buf[64], *stack = stack_buf;
+  size_t cap = 64, top = 0, len = 0, size = 16;
+  struct tnode **tnodes = malloc(sizeof *tnodes * size);
+
+  stack[top++] = (struct frame){tnode, 0};
+  while (top) {
+    struct frame frame = stack[--top];
+
+    if (frame.expanded) {
+      if (len == size)
+        tnodes = realloc(tnodes, sizeof *tnodes * (size *= 2));
+      tnodes[len++] = frame.tnode;
+      continue;
+    }
+
+    if (frame.tnode->visited == visited)
+      continue;
+
+    if (top + TNODE_ARGS + 1 > cap) {
+      struct frame *grown = malloc(sizeof *stack * (cap *= 2));
+      memcpy(grown, stack, sizeof *stack * top);
+      if (stack != stack_buf)
+        free(stack);
+      stack = grown;
+    }
+    frame.tnode->visited = visited;
+    stack[top++] = (struct frame){frame.tnode, 1};
+    for (int i = TNODE_ARGS; i--;)
+      if (frame.tnode->args[i] && frame.tnode->args[i]->visited != visited)
+        stack[top++] = (struct frame){frame.tnode->args[i], 0};
+  }
+
+  if (stack != stack_buf)
+    free(stack);
+  *count = len;
+  return tnodes;
+}
+
+int tnode_mark(struct tnode *tnode, struct tnode **head, int count,
+               int visited) {
+  // see `node_mark`
+
+  int len;
+  struct tnode **tnodes = tnode_walk(tnode, &len, visited);
+  for (int i = 0; head != NULL && i < len; i++)
+    tnodes[i]->next = *head, *head = tnodes[i];
+
+  free(tnodes);
+  return count + len;
+}
+
+void tnode_free(struct tnode *head, int *visited) {
+  // free the tnodes in the linked list formed by `next` fields starting at
+  // `head`, along with their bodies. gradients are only freed if they are
+  // part of the linked list too
+  for (struct tnode *next; head; head = next) {
+    next = head->next;
+    if (head->body) {
+      struct node *nodes = NULL;
+      node_mark(head->body, &nodes, 0, ++*visited), node_free(nodes, *visited);
+    }
+    free(head);
+  }
+}
+
+static void tnode_emit(FILE *fp, struct tnode *tnode, size_t used,
+                       int visited) {
+  // codegen the loop nest computing `tnode` into the scratch at `used`. see
+  // `tnode_codegen`
+
+  struct tnode **args = tnode->args;
+  size_t size = shape_size(tnode->shape);
+  int id = tnode->id, *trans = tnode->trans;
+
+  if (tnode->type != TNODE_INPUT)
+    fprintf(fp, "real_t *t%d = scratch + %zu;\n", id, used);
+
+  switch (tnode->type) {
+  case TNODE_INPUT:
+    break;
+  case TNODE_EWISE:
+    fprintf(fp, "for (int i = 0; i < %zu; i++) {\n", size);
+    for (int i = 0; i < TNODE_ARGS; i++)
+      if (args[i])
+        fprintf(fp, "real_t s%d = t%d[i];\n", tnode->params[i]->id,
+                args[i]->id);
+    node_codegen(fp, "real_t s%d = ", "s%d", tnode->body, visited);
+    fprintf(fp, "t%d[i] = s%d;\n", id, tnode->body->id);
+    fprintf(fp, "}\n");
+    break;
+  case TNODE_MATMUL:;
+    // loop order chosen so that the innermost loop walks both the output
+    // and, unless transposed, the right-hand side contiguously
+    size_t m = tnode->shape[0], n = args[0]->shape[!trans[0]],
+           p = tnode->shape[1];
+    fprintf(fp, "for (int i = 0; i < %zu; i++)\n", size);
+    fprintf(fp, "t%d[i] = 0.0;\n", id);
+    fprintf(fp, "for (int i = 0; i < %zu; i++)\n", m);
+    fprintf(fp, "for (int j = 0; j < %zu; j++)\n", n);
+    fprintf(fp, "for (int k = 0; k < %zu; k++)\n", p);
+    fprintf(fp, "t%d[i * %zu + k] += ", id, p);
+    if (trans[0])
+      fprintf(fp, "t%d[j * %zu + i] * ", args[0]->id, m);
+    else
+      fprintf(fp, "t%d[i * %zu + j] * ", args[0]->id, n);
+    if (trans[1])
+      fprintf(fp, "t%d[k * %zu + j];\n", args[1]->id, n);
+    else
+      fprintf(fp, "t%d[j * %zu + k];\n", args[1]->id, p);
+    break;
+  case TNODE_SUM:
+    fprintf(fp, "t%d[0] = 0.0;\n", id);
+    fprintf(fp, "for (int i = 0; i < %zu; i++)\n", shape_size(args[0]->shape));
+    fprintf(fp, "t%d[0] += t%d[i];\n", id, args[0]->id);
+    break;
+  case TNODE_LOGSUMEXP:
+    // shift by the maximum so that `exp` can neither overflow nor underflow
+    // every term to zero
+    size = shape_size(args[0]->shape);
+    fprintf(fp, "t%d[0] = -HUGE_VAL;\n", id);
+    fprintf(fp, "for (int i = 0; i < %zu; i++)\n", size);
+    fprintf(fp, "t%d[0] = op_max(t%d[0], t%d[i]);\n", id, id, args[0]->id);
+    fprintf(fp, "{\nreal_t sum = 0.0;\n");
+    fprintf(fp, "for (int i = 0; i < %zu; i++)\n", size);
+    fprintf(fp, "sum += op_exp(t%d[i] - t%d[0]);\n", args[0]->id, id);
+    fprintf(fp, "t%d[0] += op_log(sum);\n}\n", id);
+    break;
+  case TNODE_REPEAT:
+    fprintf(fp, "for (int i = 0; i < %zu; i++)\n", size);
+    fprintf(fp, "t%d[i] = t%d[0];\n", id, args[0]->id);
+    break;
+  }
+}
+
+size_t tnode_codegen(FILE *fp, struct tnode *tnode, size_t used,
+                     int visited) {
+  // codegen tnode into C source code, one loop nest per tnode. the array
+  // holding the elements of a tnode is named `t` followed by its `id` and the
+  // temporaries of bodies `s` followed by their `id`, so `real_t *tN` must be
+  // declared beforehand for every `TNODE_INPUT`. arrays of other tnodes are
+  // laid out back to back in `real_t *scratch` from element `used` on, so
+  // their size is not bounded by that of the stack. returns the number of
+  // elements of `scratch` used so far, which the generated code must declare
+  // beforehand and provide room for. make sure to call with a unique
+  // `visited`
+
+  int len;
+  struct tnode **tnodes = tnode_walk(tnode, &len, visited);
+  for (int t = 0; t < len; t++) {
+    tnode_emit(fp, tnodes[t], used, visited);
+    if (tnodes[t]->type != TNODE_INPUT)
+      used += shape_size(tnodes[t]->shape);
+  }
+
+  free(tnodes);
+  return used;
+}
+
+static struct node *node_subst(struct node *node, struct node *from[],
+                               struct node *to[], int count, int visited) {
+  // copy `node` and its dependencies, substituting `to[i]` for `from[i]`.
+  // make sure to call with a unique `visited`
+
+  for (int i = 0; i < count; i++)
+    from[i]->visited = visited, from[i]->next = to[i];
+
+  struct node *head = NULL;
+  int len = node_mark(node, &head, 0, visited); // reverse topological order
+
+  struct node **nodes = malloc(sizeof *nodes * len);
+  for (int i = len; i--; head = head->next)
+    nodes[i] = head;
+
+  for (int i = 0; i < len; i++) {
+    struct node *node = nodes[i];
+    switch (node->type) {
+#define SUBST_LIT(UC, LC)                                                      \
+  case NODE_##UC:                                                              \
+    node->next = node_##LC(node->val);                                         \
+    break;
+#define SUBST_UNOP(UC, LC)                                                     \
+  case NODE_##UC:                                                              \
+    node->next = node_##LC(node->lhs->next);                                   \
+    break;
+#define SUBST_BINOP(UC, LC)                                                    \
+  case NODE_##UC:                                                              \
+    node->next = node_##LC(node->lhs->next, node->rhs->next);                  \
+    break;
+
+      NODE_TYPES(SUBST_LIT, SUBST_UNOP, SUBST_BINOP)
+
+#undef SUBST_LIT
+#undef SUBST_UNOP
+#undef SUBST_BINOP
+    }
+  }
+
+  free(nodes);
+  return node->next;
+}
+
+static void tnode_ewise_grad(struct tnode *tnode, struct tnode *grads[],
+                             int *visited) {
+  // derivatives of the `args` of a `TNODE_EWISE` with respect to it, chained
+  // with `tnode->grad`. the partial derivatives of `body` are found using
+  // `node_grad` then copied into the bodies of new `TNODE_EWISE`s, whose
+  // operands are whichever of `args`, `tnode` and `tnode->grad` they use
+
+  struct arena *arena = arena_use(NULL);
+  struct node *body = tnode->body, *nodes = NULL;
+  body->grad = node_lit(1.0), node_grad(body, ++*visited);
+
+  for (int i = 0; i < TNODE_ARGS; i++) {
+    if (tnode->args[i] == NULL || tnode->params[i]->grad == NULL)
+      continue;
+
+    struct tnode *args[TNODE_ARGS + 2];
+    struct node *from[TNODE_ARGS + 1], *to[TNODE_ARGS + 2];
+    int count = 0;
+    for (int j = 0; j < TNODE_ARGS; j++)
+      if (tnode->args[j])
+        from[count] = tnode->params[j], args[count++] = tnode->args[j];
+    from[count] = body, args[count++] = tnode;
+    args[count++] = tnode->grad;
+    for (int j = 0; j < count; j++)
+      to[j] = node_lit(NAN);
+
+    struct node *grad = node_mul(
+        node_subst(tnode->params[i]->grad, from, to, count - 1, ++*visited),
+        to[count - 1]); // chain rule
+    grad = node_simplify(grad, ++*visited);
+
+    struct tnode *ewise = tnode_new(TNODE_EWISE, tnode->args[i]->shape);
+    node_mark(grad, NULL, 0, ++*visited);
+    for (int j = 0, k = 0; j < count; j++) {
+      if (to[j]->visited != *visited) {
+        free(to[j]); // unused placeholder
+        continue;
+      }
+      if (k == TNODE_ARGS)
+        abort();
+      ewise->args[k] = args[j], ewise->params[k++] = to[j];
+    }
+    ewise->body = grad;
+    grads[i] = ewise;
+  }
+
+  node_mark(body, &nodes, 0, ++*visited), node_zerograd(nodes, *visited);
+  arena_use(arena);
+}
+
+void tnode_grad(struct tnode *tnode, int *visited) {
+  // compute derivative of `tnode` and its dependencies with respect to
+  // `tnode` and store results in `grad` fields. before calling make sure that
+  // all dependencies' `grad`s hold `NULL` and that `tnode->grad` holds the
+  // seed, usually `tnode_lit(tnode->shape, 1.0)`
+
+  struct tnode *head = NULL;
+  tnode_mark(tnode, &head, 0, ++*visited); // reverse topological order
+
+  for (; head; head = head->next) {
+    struct tnode *grads[TNODE_ARGS] = {0}, **args = head->args;
+    struct tnode *grad = head->grad;
+    int *trans = head->trans;
+
+    if (grad == NULL)
+      continue;
+
+    // derivatives of `head->args` with respect to `head`
+    switch (head->type) {
+    case TNODE_INPUT:
+      break;
+    case TNODE_EWISE:
+      tnode_ewise_grad(head, grads, visited);
+      break;
+    case TNODE_MATMUL:
+      grads[0] = trans[0] ? tnode_gemm(args[1], trans[1], grad, 1)
+                          : tnode_gemm(grad, 0, args[1], !trans[1]);
+      grads[1] = trans[1] ? tnode_gemm(grad, 1, args[0], trans[0])
+                          : tnode_gemm(args[0], !trans[0], grad, 0);
+      break;
+    case TNODE_SUM:
+      grads[0] = tnode_repeat(args[0]->shape, grad);
+      break;
+    case TNODE_LOGSUMEXP:; // the softmax of `args[0]`
+      struct tnode *diff = tnode_binop(node_sub, args[0],
+                                       tnode_repeat(args[0]->shape, head));
+      grads[0] = tnode_binop(node_mul, tnode_unop(node_exp, diff),
+                             tnode_repeat(args[0]->shape, grad));
+      break;
+    case TNODE_REPEAT:
+      grads[0] = tnode_sum(grad);
+      memcpy(grads[0]->shape, args[0]->shape, sizeof grads[0]->shape);
+      break;
+    }
+
+    for (int i = 0; i < TNODE_ARGS; i++)
+      if (grads[i])
+        args[i]->grad = args[i]->grad
+                            ? tnode_binop(node_add, args[i]->grad, grads[i])
+                            : grads[i]; // gradient accumulation
+  }
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+
+// tensor-granularity counterpart of `struct node`. where `tensor_matmul` and
+// friends lower to one `struct node` per scalar operation, a `struct tnode` is
+// a whole array operation, which `tnode_codegen` turns into a loop. element-
+// wise operations carry a scalar `struct node` graph as their loop body, so
+// their derivatives are found by `node_grad` itself. shapes are `shape_t`s
+// from tensor.h, which must be included first
+
+#define TNODE_ARGS 4 // maximum number of operands of a `struct tnode`
+
+struct tnode {
+  enum tnode_type {
+    TNODE_INPUT,     // array provided by the caller of the generated code
+    TNODE_EWISE,     // `body` applied element-wise over `args` of equal shapes
+    TNODE_MATMUL,    // matrix product of `args[0]` and `args[1]`
+    TNODE_SUM,       // sum of all elements of `args[0]`
+    TNODE_LOGSUMEXP, // log of the sum of exponentials of all elements of
+                     // `args[0]`, without overflowing
+    TNODE_REPEAT,    // `shape` filled with the single element of `args[0]`
+  } type;
+  int id, visited;                 // for tnode graph traversal
+  shape_t shape;                   // must be null terminated
+  struct tnode *args[TNODE_ARGS];  // operands; unused ones are `NULL`
+  struct node *body;               // for `TNODE_EWISE`, function of `params`
+  struct node *params[TNODE_ARGS]; // `node_lit(NAN)`s standing for `args`
+  int trans[2];                    // for `TNODE_MATMUL`, transpose operands
+  struct tnode *next;              // for output of `tnode_mark`
+  struct tnode *grad;              // for output of `tnode_grad`
+};
+
+struct tnode *tnode_input(shape_t shape);
+struct tnode *tnode_lit(shape_t shape, double val);
+struct tnode *tnode_unop(struct node *(*unop)(struct node *lhs),
+                         struct tnode *lhs);
+struct tnode *tnode_binop(struct node *(*binop)(struct node *lhs,
+                                                struct node *rhs),
+                          struct tnode *lhs, struct tnode *rhs);
+struct tnode *tnode_matmul(struct tnode *lhs, struct tnode *rhs);
+struct tnode *tnode_sum(struct tnode *tnode);
+struct tnode *tnode_logsumexp(struct tnode *tnode);
+struct tnode *tnode_repeat(shape_t shape, struct tnode *item);
+
+int tnode_mark(struct tnode *tnode, struct tnode **head, int count,
+               int visited);
+void tnode_free(struct tnode *head, int *visited);
+size_t tnode_codegen(FILE *fp, struct tnode *tnode, size_t used,
+                     int visited);
+void tnode_grad(struct tnode *tnode, int *visited);
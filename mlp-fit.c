@@ -1,15 +1,35 @@
+#define _POSIX_C_SOURCE 200809L // for `mmap` and `open`
+#include "lib/pool.h"
 #include "mlp.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
-#ifndef __STDC_NO_THREADS__
-#include <threads.h>
-#ifndef __STDC_NO_ATOMICS__
-#include <stdatomic.h>
+#include <unistd.h>
+
+#define THREADS 0  // worker threads, or 0 for one per online processor
+#define SHARD 4096 // parameters per chunk of the gradient reduction
+
+// asynchronous training, Hogwild-style: every worker runs whole update steps
+// on its own and applies them to the shared weights without locking
+#ifndef ASYNC
+#define ASYNC 0 // 1 to train asynchronously
+#endif
+#ifndef STALENESS
+#define STALENESS 1 // steps a worker takes before reading the weights again
 #endif
+#ifndef LOSSLESS
+#define LOSSLESS 0 // 1 to apply updates with compare-and-swap, losing none
 #endif
 
-#define THREADS 16
+#if ASYNC
+#ifdef __STDC_NO_ATOMICS__
+#error "asynchronous training requires atomics"
+#endif
+#include <stdatomic.h>
+#endif
 
 // // faster (90% accuracy)
 // #define ETA 0.05   // learning rate
@@ -25,12 +45,8 @@
 #define BATCH 250   // mini-batch size
 #define ITERS 10000 // number of update steps
 
-#define TRAIN_LEN 60000
-#define TRAIN_OFSTS 16, 8
 #define TRAIN_PATHS                                                            \
   "MNIST/train-images.idx3-ubyte", "MNIST/train-labels.idx1-ubyte"
-#define TEST_LEN 10000
-#define TEST_OFSTS 16, 8
 #define TEST_PATHS                                                             \
   "MNIST/t10k-images.idx3-ubyte", "MNIST/t10k-labels.idx1-ubyte"
 
@@ -39,44 +55,67 @@
     for (double elem = (ARRAY)[idx], *_p = &elem; _p;                          \
          (ARRAY)[idx] = elem, _p = NULL)
 
-struct ex {
-  x_t x;
-  y_t y;
+// an IDX file of unsigned bytes, mapped into memory as is. items are only
+// converted to `x_t`s and `y_t`s once gathered, by `mnist_x` and `mnist_y`
+struct idx_file {
+  unsigned char *data; // items back to back, one byte per element
+  size_t len, size;    // number of items and number of elements per item
+  void *map;           // from `mmap`
+  size_t map_size;
 };
 
-struct ex *load_mnist(char *x_path, char *y_path, long x_ofst, long y_ofst,
-                      size_t len) {
-  FILE *x_fp = fopen(x_path, "r"), *y_fp = fopen(y_path, "r");
-  if (x_fp == NULL || y_fp == NULL)
-    perror("fopen"), exit(EXIT_FAILURE);
-  if (fseek(x_fp, x_ofst, SEEK_SET) == EOF ||
-      fseek(y_fp, y_ofst, SEEK_SET) == EOF)
-    perror("fseek"), exit(EXIT_FAILURE);
-
-  struct ex *exs = malloc(sizeof *exs * len);
-
-  int chr;
-  for (size_t i = 0; i < len; i++) {
-    struct ex *ex = exs + i;
-
-    if ((chr = fgetc(y_fp)) == EOF)
-      perror("fgetc"), exit(EXIT_FAILURE);
-    if (chr >= sizeof ex->y / sizeof *ex->y)
-      abort();
-    ARRAY_FOR(ex->y) elem = 0.0;
-    ex->y[chr] = 1.0;
-
-    ARRAY_FOR(ex->x) {
-      if ((chr = fgetc(x_fp)) == EOF)
-        perror("fgetc"), exit(EXIT_FAILURE);
-      elem = (double)chr / 256.0;
-    }
+struct idx_file load_idx(char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+    perror("open"), exit(EXIT_FAILURE);
+
+  size_t map_size = st.st_size;
+  unsigned char *map =
+      map_size < 4 ? MAP_FAILED
+                   : mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED || close(fd) == -1)
+    perror("mmap"), exit(EXIT_FAILURE);
+
+  // two zero bytes, a type code, a number of dimensions, then the size of
+  // every dimension as a big-endian 32-bit integer. type code 0x08 is for
+  // unsigned bytes. the first dimension indexes items
+  size_t dims = map[3], ofst = 4 + 4 * dims;
+  if (map[0] || map[1] || map[2] != 0x08 || dims == 0 || map_size < ofst)
+    fprintf(stderr, "%s: not an IDX file of bytes\n", path),
+        exit(EXIT_FAILURE);
+
+  struct idx_file idx_file = {map + ofst, 0, 1, map, map_size};
+  for (size_t d = 0; d < dims; d++) {
+    unsigned char *be = map + 4 + 4 * d;
+    size_t dim = (size_t)be[0] << 24 | be[1] << 16 | be[2] << 8 | be[3];
+    d ? (idx_file.size *= dim) : (idx_file.len = dim);
   }
+  if (ofst + idx_file.len * idx_file.size != map_size)
+    fprintf(stderr, "%s: truncated\n", path), exit(EXIT_FAILURE);
 
-  if (fclose(x_fp) == EOF || fclose(y_fp) == EOF)
-    perror("fclose"), exit(EXIT_FAILURE);
+  return idx_file;
+}
+
+void load_mnist(char *x_path, char *y_path, struct idx_file *x,
+                struct idx_file *y) {
+  *x = load_idx(x_path), *y = load_idx(y_path);
+  if (x->len != y->len || y->size != 1)
+    fprintf(stderr, "%s, %s: not MNIST\n", x_path, y_path),
+        exit(EXIT_FAILURE);
+}
+
+void mnist_x(x_t *x, struct idx_file *xs, size_t i) {
+  if (xs->size != sizeof *x / sizeof **x)
+    abort();
+  unsigned char *data = xs->data + i * xs->size;
+  ARRAY_FOR(*x) elem = (double)data[idx] / 256.0;
+}
 
-  return exs;
+void mnist_y(y_t *y, struct idx_file *ys, size_t i) {
+  if (ys->data[i] >= sizeof *y / sizeof **y)
+    abort();
+  ARRAY_FOR(*y) elem = idx == ys->data[i];
 }
 
 int mnist_y_to_yi(y_t *y) {
@@ -98,22 +137,6 @@ void mnist_y_dump(y_t *y) {
   putchar('\n');
 }
 
-#ifndef __STDC_NO_THREADS__
-struct arg {
-  unsigned seed;
-  struct ex *exs;
-  w_t *w;
-  dw_t *dw;
-  c_t *c;
-};
-
-mtx_t sync_lock;
-cnd_t work_avail, work_done;
-int thrds_working;
-#ifndef __STDC_NO_ATOMICS__
-_Atomic int exs_left;
-#endif
-
 // ISO/IEC 9899:TC3, $7.20.2.2, paragraph 5
 #define RAND_R_MAX 32767
 int rand_r(unsigned *seedp) {
@@ -121,144 +144,234 @@ int rand_r(unsigned *seedp) {
   return *seedp / 65536 % 32768;
 }
 
-int worker_thrd(void *arg) {
-  struct arg *a = arg;
-  unsigned seed = a->seed;
+void print_loss(int iter, double loss) {
+  printf("iter %d of %d; loss %f", iter, ITERS, loss);
+  printf("%*s\n", (int)(loss * 64), "#");
+}
+
+// state private to every worker of the pool, so that workers accumulate
+// gradients without synchronizing
+struct worker {
+  unsigned seed; // standard `rand()` is not required to be thread safe
+  scratch_t *s;  // weights are loaded into it once per update
   dw_t dw;
   c_t c;
+  x_t xs[MLP_LANES];
+  y_t ys[MLP_LANES];
+#if ASYNC
+  w_t w;     // snapshot of the shared weights
+  dw_t v;    // momentum, kept per worker
+  int steps; // steps taken since the snapshot
+#endif
+};
 
-  mtx_lock(&sync_lock);
-
-  while (thrds_working != EOF) {
-    mtx_unlock(&sync_lock);
+struct batch {
+  struct idx_file *xs, *ys;
+  w_t *w;
+  dw_t *dw;
+  struct worker *workers;
+  int threads;
+};
 
-    ARRAY_FOR(dw) elem = 0.0;
-    *c = 0.0;
+void backprop_lanes(struct batch *b, struct worker *wk, int n) {
+  // gather `n` random examples, at most `MLP_LANES`, and backpropagate
+  // through them at once, with the weights last loaded into the scratch
+  x_t *x[MLP_LANES];
+  y_t *y[MLP_LANES];
+  for (int i = 0; i < n; i++) {
+    size_t idx =
+        rand_r(&wk->seed) * (RAND_R_MAX + (size_t)1) + rand_r(&wk->seed);
+    mnist_x(wk->xs + i, b->xs, idx % b->xs->len);
+    mnist_y(wk->ys + i, b->ys, idx % b->ys->len);
+    x[i] = wk->xs + i, y[i] = wk->ys + i;
+  }
+  mlp_backprop_batch(n, x, y, *wk->s, wk->dw, wk->c);
+}
 
-#ifndef __STDC_NO_ATOMICS__
-    while (atomic_fetch_sub_explicit(&exs_left, 1, memory_order_relaxed) > 0)
-#else
-    for (int ex = 0; ex < BATCH / THREADS; ex++)
-#endif
-    {
-      // standard `rand()` is not required to be thread safe
-      size_t idx = rand_r(&seed) * (RAND_R_MAX + (size_t)1) + rand_r(&seed);
-      struct ex *ex = a->exs + idx % TRAIN_LEN;
-      mlp_backprop(ex->x, *a->w, ex->y, dw, c);
-    }
+void backprop_task(void *arg, int worker, int begin, int end) {
+  struct batch *b = arg;
+  backprop_lanes(b, b->workers + worker, end - begin);
+}
 
-    ARRAY_FOR(dw) elem /= BATCH;
-    *c /= BATCH;
+void load_task(void *arg, int worker, int begin, int end) {
+  // load the weights into the scratch of workers `begin` through `end - 1`
+  struct batch *b = arg;
+  (void)worker;
+  for (int i = begin; i < end; i++)
+    mlp_backprop_load(*b->w, *b->workers[i].s);
+}
 
-    mtx_lock(&sync_lock);
+void reduce_task(void *arg, int worker, int begin, int end) {
+  // sum a shard of the gradients of every worker into `dw`, averaged over the
+  // mini-batch, and zero it for the next step. shards are disjoint, so this
+  // needs no synchronization
+  struct batch *b = arg;
+  (void)worker;
+  for (int i = begin; i < end; i++)
+    (*b->dw)[i] = 0.0;
+  for (struct worker *wk = b->workers; wk < b->workers + b->threads; wk++)
+    for (int i = begin; i < end; i++)
+      (*b->dw)[i] += wk->dw[i], wk->dw[i] = 0.0;
+  for (int i = begin; i < end; i++)
+    (*b->dw)[i] /= BATCH;
+}
 
-    ARRAY_FOR(*a->dw) elem += dw[idx];
-    **a->c += *c;
+#if ASYNC
+static _Atomic real_t shared_w[sizeof(w_t) / sizeof(real_t)];
+
+// losses of steps are printed in order as they become available, by whichever
+// worker gets to it first. no worker ever waits on another to report
+static double losses[ITERS];
+static _Atomic int reported[ITERS];
+static int printed;
+static atomic_flag printing = ATOMIC_FLAG_INIT;
+static _Atomic int next_step;
+
+void report_losses(void) {
+  if (atomic_flag_test_and_set(&printing))
+    return; // another worker is printing and may pick up our step
+  while (printed < ITERS && atomic_load(reported + printed))
+    print_loss(printed, losses[printed]), printed++;
+  atomic_flag_clear(&printing);
+}
 
-    thrds_working--;
-    cnd_signal(&work_done);
-    cnd_wait(&work_avail, &sync_lock);
-  }
+void async_task(void *arg, int worker, int begin, int end) {
+  // take `end - begin` update steps, each over its own mini-batch. steps are
+  // numbered in the order they start rather than by item, as the pool hands
+  // out items in no particular order. reads and writes of `shared_w` are
+  // relaxed, so other workers see updates eventually and in no particular
+  // order
+  struct batch *b = arg;
+  struct worker *wk = b->workers + worker;
+
+  for (int i = begin; i < end; i++) {
+    int step = atomic_fetch_add(&next_step, 1);
+    if (wk->steps++ % STALENESS == 0) {
+      ARRAY_FOR(wk->w)
+      elem = atomic_load_explicit(shared_w + idx, memory_order_relaxed);
+    }
 
-  mtx_unlock(&sync_lock);
+    mlp_backprop_load(wk->w, *wk->s);
+    *wk->c = 0.0;
+    for (int left = BATCH; left > 0; left -= MLP_LANES)
+      backprop_lanes(b, wk, left < MLP_LANES ? left : MLP_LANES);
+
+    ARRAY_FOR(wk->dw) {
+      elem = elem / BATCH + LAMBDA * wk->w[idx] * wk->w[idx];
+      double v = wk->v[idx] = wk->v[idx] * BETA - ETA * elem;
+      wk->w[idx] += v, elem = 0.0;
+#if LOSSLESS
+      real_t old = atomic_load_explicit(shared_w + idx, memory_order_relaxed);
+      while (!atomic_compare_exchange_weak_explicit(
+          shared_w + idx, &old, old + v, memory_order_relaxed,
+          memory_order_relaxed))
+        ;
+#else
+      // updates racing on the same weight may overwrite one another
+      atomic_store_explicit(
+          shared_w + idx,
+          atomic_load_explicit(shared_w + idx, memory_order_relaxed) + v,
+          memory_order_relaxed);
+#endif
+    }
 
-  return 0;
+    losses[step] = *wk->c / BATCH;
+    atomic_store(reported + step, 1);
+    report_losses();
+  }
 }
-#endif // __STDC_NO_THREADS__
+#endif // ASYNC
 
 int main(void) {
   srand(time(NULL));
 
-  struct ex *train_exs = load_mnist(TRAIN_PATHS, TRAIN_OFSTS, TRAIN_LEN);
-  struct ex *test_exs = load_mnist(TEST_PATHS, TEST_OFSTS, TEST_LEN);
+  struct idx_file train_x, train_y, test_x, test_y;
+  load_mnist(TRAIN_PATHS, &train_x, &train_y);
+  load_mnist(TEST_PATHS, &test_x, &test_y);
 
   static w_t w;
   static yh_t yh;
   static dw_t dw;
+#if !ASYNC
   static c_t c;
   static dw_t v;
+#endif
+  static x_t x;
+  static y_t y;
 
+#if !ASYNC
   ARRAY_FOR(v) elem = 0.0;
+#endif
   ARRAY_FOR(w) elem = (double)rand() / RAND_MAX - 0.5;
 
-#ifndef __STDC_NO_THREADS__
-  mtx_init(&sync_lock, mtx_plain);
-  cnd_init(&work_avail), cnd_init(&work_done);
-
-  mtx_lock(&sync_lock);
-
-  struct arg args[THREADS];
-  thrd_t thrds[THREADS];
-  for (int i = 0; i < THREADS; i++) {
-    args[i] = (struct arg){rand(), train_exs, &w, &dw, &c};
-    thrd_create(thrds + i, worker_thrd, args + i);
-  }
+  struct pool *pool = pool_create(THREADS);
+  int threads = pool_threads(pool);
+  struct worker *workers = malloc(sizeof *workers * threads);
+  for (struct worker *wk = workers; wk < workers + threads; wk++) {
+    wk->seed = rand();
+    if ((wk->s = malloc(sizeof *wk->s)) == NULL)
+      perror("malloc"), exit(EXIT_FAILURE);
+    ARRAY_FOR(wk->dw) elem = 0.0;
+#if ASYNC
+    ARRAY_FOR(wk->v) elem = 0.0;
+    wk->steps = 0;
 #endif
+  }
+  struct batch batch = {&train_x, &train_y, &w, &dw, workers, threads};
 
+#if ASYNC
+  ARRAY_FOR(w) atomic_init(shared_w + idx, elem);
+  pool_run(pool, ITERS, 1, async_task, &batch);
+  report_losses(); // in case the last steps were done while printing
+  ARRAY_FOR(w) elem = atomic_load(shared_w + idx);
+#else
   for (int iter = 0; iter < ITERS; iter++) {
-    ARRAY_FOR(dw) elem = 0.0;
-    *c = 0.0;
+    for (struct worker *wk = workers; wk < workers + threads; wk++)
+      *wk->c = 0.0;
 
-#ifndef __STDC_NO_THREADS__
-#ifndef __STDC_NO_ATOMICS__
-    exs_left = BATCH;
-#endif
-    thrds_working = THREADS;
-    cnd_broadcast(&work_avail);
-    while (thrds_working)
-      cnd_wait(&work_done, &sync_lock);
-#else
-    for (int ex = 0; ex < BATCH; ex++) {
-      // ISO/IEC 9899:TC3, $7.20.2.1 requires RAND_MAX to be at least 32767
-      size_t idx = rand() * (RAND_MAX + (size_t)1) + rand();
-      struct ex *ex = train_exs + idx % TRAIN_LEN;
-      mlp_backprop(ex->x, w, ex->y, dw, c);
-    }
+    pool_run(pool, threads, 1, load_task, &batch);
+    pool_run(pool, BATCH, MLP_LANES, backprop_task, &batch);
+    pool_run(pool, sizeof dw / sizeof *dw, SHARD, reduce_task, &batch);
 
-    ARRAY_FOR(dw) elem /= BATCH;
+    *c = 0.0;
+    for (struct worker *wk = workers; wk < workers + threads; wk++)
+      *c += *wk->c;
     *c /= BATCH;
-#endif
 
     ARRAY_FOR(dw) elem += LAMBDA * w[idx] * w[idx];  // L2 regularization
     ARRAY_FOR(v) elem = elem * BETA - ETA * dw[idx]; // momentum
     ARRAY_FOR(w) elem += v[idx];                     // gradient descent
 
-    printf("iter %d of %d; loss %f", iter, ITERS, *c);
-    printf("%*s\n", (int)(*c * 64), "#");
+    print_loss(iter, *c);
   }
-
-#ifndef __STDC_NO_THREADS__
-  thrds_working = EOF;
-  cnd_broadcast(&work_avail);
-  mtx_unlock(&sync_lock);
-
-  for (int i = 0; i < THREADS; i++)
-    thrd_join(thrds[i], NULL);
-
-  mtx_destroy(&sync_lock);
-  cnd_destroy(&work_avail), cnd_destroy(&work_done);
 #endif
 
+  for (struct worker *wk = workers; wk < workers + threads; wk++)
+    free(wk->s);
+  pool_destroy(pool), free(workers);
+
   double accuracy = 0.0;
 
-  for (size_t i = 0; i < TEST_LEN; i++) {
-    struct ex *ex = test_exs + i;
-    mlp_predict(ex->x, w, yh);
+  for (size_t i = 0; i < test_x.len; i++) {
+    mnist_x(&x, &test_x, i), mnist_y(&y, &test_y, i);
+    mlp_predict(x, w, yh);
 
-    int correct = mnist_y_to_yi(&yh) == mnist_y_to_yi(&ex->y);
-    accuracy += (double)correct / TEST_LEN;
+    int correct = mnist_y_to_yi(&yh) == mnist_y_to_yi(&y);
+    accuracy += (double)correct / test_x.len;
 
     if (correct)
       continue;
 
     printf("yh  = "), mnist_y_dump(&yh);
-    printf("y   = "), mnist_y_dump(&ex->y);
+    printf("y   = "), mnist_y_dump(&y);
     printf("yhi = %d\n", mnist_y_to_yi(&yh));
-    printf("yi  = %d\n", mnist_y_to_yi(&ex->y));
-    mnist_x_dump(&ex->x);
+    printf("yi  = %d\n", mnist_y_to_yi(&y));
+    mnist_x_dump(&x);
   }
 
   printf("accuracy: %f\n", accuracy);
 
-  free(train_exs), free(test_exs);
+  struct idx_file *idx_files[] = {&train_x, &train_y, &test_x, &test_y};
+  for (int i = 0; i < 4; i++)
+    munmap(idx_files[i]->map, idx_files[i]->map_size);
 }
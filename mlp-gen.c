@@ -1,9 +1,54 @@
 #include "lib/autodiff.h"
+#include "lib/tape.h"
 #include "lib/tensor.h"
 #include "utils.h"
 #include <stdlib.h>
 
+#define LANES 8 // examples evaluated at once by `mlp_backprop_batch`
+
+// functions and source files `mlp_backprop` is split into. the Makefile
+// passes its own `SHARDS` so it knows which objects to build
+#ifndef SHARDS
+#define SHARDS 32
+#endif
+
+// precision of generated code in bits, either 32 or 64. see runtime.h
+#ifndef PRECISION
+#define PRECISION 64
+#endif
+#define REAL (PRECISION == 32 ? "float" : "double")
+
+// nonzero to dump statistics about the graph of every layer, the forward and
+// backward graphs and time spent in autodiff phases to standard error
+#ifndef STATS
+#define STATS 0
+#endif
+
+static void gen_load(FILE *fp, int temp, size_t slot, size_t x_size,
+                     size_t w_size) {
+  // codegen loading the input at `slot` of the tape in `main` into temporary
+  // `temp`. inputs are x, w then y
+  if (slot < x_size)
+    fprintf(fp, "t%d = x[%zd];\n", temp, slot);
+  else if (slot < x_size + w_size)
+    fprintf(fp, "t%d = w[%zd];\n", temp, slot - x_size);
+  else
+    fprintf(fp, "t%d = y[%zd];\n", temp, slot - x_size - w_size);
+}
+
+static int gen_temp(FILE *fp, int idle[], int *idles, int *temps) {
+  // hand out a temporary of a shard, reusing an idle one if any and otherwise
+  // codegen the declaration of a new one
+  if (*idles > 0)
+    return idle[--*idles];
+  fprintf(fp, "real_t t%d;\n", *temps);
+  return (*temps)++;
+}
+
 int main(void) {
+  struct arena *arena = arena_create(1);
+  arena_use(arena);
+
   struct tensor l0 = col_tensor(MOVE tensor_nans((shape_t){28 * 28}));
 
   struct tensor b1 = col_tensor(MOVE tensor_nans((shape_t){64}));
@@ -22,12 +67,11 @@ int main(void) {
   struct tensor w3 = tensor_nans((shape_t){*b3.shape, *l2.shape});
   struct tensor z3 =
       tensor_binop(node_add, REF b3, MOVE tensor_matmul(REF w3, REF l2));
-  struct tensor l3 = tensor_softmax(MOVE z3);
+  struct tensor l3 = tensor_softmax(REF z3);
 
-  free(l1.data), free(l2.data);
   struct tensor x = (MOVE l0), yh = (MOVE l3);
   struct tensor y = tensor_nans(yh.shape);
-  struct node *c = tensor_crossentropy(REF y, REF yh);
+  struct node *c = tensor_softmax_crossentropy(REF y, MOVE z3);
 
   struct tensor w =
       tensor_collect((bool[]){MOVE MOVE MOVE MOVE MOVE MOVE},
@@ -35,53 +79,283 @@ int main(void) {
 
   FILE *p_fp = fopen("mlp-predict.c", "w");
   FILE *b_fp = fopen("mlp-backprop.c", "w");
+  FILE *bb_fp = fopen("mlp-backprop-batch.c", "w");
   FILE *h_fp = fopen("mlp.h", "w");
-  if (p_fp == NULL || b_fp == NULL || h_fp == NULL)
+  if (p_fp == NULL || b_fp == NULL || bb_fp == NULL || h_fp == NULL)
     perror("fopen"), exit(EXIT_FAILURE);
 
-  int visited = 0;
+  int visited = 0, before, after;
+
+  if (STATS) {
+    // graphs of layers include those of earlier layers
+    struct tensor layers[] = {l1, l2, yh};
+    for (int i = 0, prev = 0; i < 3; i++) {
+      char name[16];
+      snprintf(name, sizeof name, "layer %d", i + 1);
+      struct node_stats stats = node_stats(
+          layers[i].data, shape_size(layers[i].shape), ++visited);
+      node_stats_print(stderr, name, &stats);
+      fprintf(stderr, "%s: %d nodes added\n", name, stats.nodes - prev);
+      prev = stats.nodes, node_stats_free(&stats);
+    }
+  }
+  free(l1.data), free(l2.data);
+
+  before = node_mark(c, NULL, 0, ++visited);
+  c = node_simplify(c, ++visited);
+  TENSOR_FOR(yh) node = node_simplify(node, visited);
+  after = node_mark(c, NULL, 0, ++visited);
+  fprintf(stderr, "forward: %d nodes, %d eliminated\n", after, before - after);
+
+  TENSOR_FOR(w) node->grad = node_lit(0.0);
+  c->grad = node_lit(1.0), node_grad(c, ++visited);
 
+  before = node_mark(c, NULL, 0, ++visited);
+  TENSOR_FOR(w) before = node_mark(node->grad, NULL, before, visited);
+  ++visited;
+  TENSOR_FOR(w) node->grad = node_simplify(node->grad, visited);
+  after = node_mark(c, NULL, 0, ++visited);
+  TENSOR_FOR(w) after = node_mark(node->grad, NULL, after, visited);
+  fprintf(stderr, "backward: %d nodes, %d eliminated\n", after, before - after);
+
+  if (STATS) {
+    struct node **roots = malloc(sizeof *roots * (1 + shape_size(w.shape)));
+    roots[0] = c;
+    TENSOR_FOR(w) roots[1 + idx] = node->grad;
+    struct node_stats fwd = node_stats(&c, 1, ++visited);
+    struct node_stats bwd = node_stats(roots, 1 + shape_size(w.shape),
+                                       ++visited);
+    node_stats_print(stderr, "forward", &fwd);
+    node_stats_print(stderr, "backward", &bwd);
+    fprintf(stderr, "backward: %.2fx the nodes of forward\n",
+            (double)bwd.nodes / fwd.nodes);
+    node_stats_free(&fwd), node_stats_free(&bwd), free(roots);
+  }
+
+  // temporaries are renumbered by `node_slots`, which must only happen once
+  // done building graphs. number inputs densely and temporaries past them
+  int inputs = 0, peak;
+  TENSOR_FOR(x) node->id = inputs++;
+  TENSOR_FOR(w) node->id = inputs++;
+  TENSOR_FOR(y) node->id = inputs++;
+
+  if (PRECISION == 32)
+    fprintf(h_fp, "#define RUNTIME_FLOAT\n");
+  fprintf(h_fp, "typedef %s real_t;\n", REAL); // same as in runtime.h
   fprintf(p_fp, "#include \"mlp.h\"\n");
   fprintf(p_fp, "#include \"runtime.h\"\n");
-  fprintf(h_fp, "typedef double x_t[%zd];\n", shape_size(x.shape));
-  fprintf(h_fp, "typedef double w_t[%zd];\n", shape_size(w.shape));
-  fprintf(h_fp, "typedef double yh_t[%zd];\n", shape_size(yh.shape));
+  fprintf(h_fp, "typedef %s x_t[%zd];\n", REAL, shape_size(x.shape));
+  fprintf(h_fp, "typedef %s w_t[%zd];\n", REAL, shape_size(w.shape));
+  fprintf(h_fp, "typedef %s yh_t[%zd];\n", REAL, shape_size(yh.shape));
   fprintf(h_fp, "void mlp_predict(x_t x, w_t w, yh_t yh);\n");
   fprintf(p_fp, "void mlp_predict(x_t x, w_t w, yh_t yh) {\n");
-  TENSOR_FOR(x) fprintf(p_fp, "double t%d = x[%zd];\n", node->id, idx);
-  TENSOR_FOR(w) fprintf(p_fp, "double t%d = w[%zd];\n", node->id, idx);
+  TENSOR_FOR(x) fprintf(p_fp, "real_t t%d = x[%zd];\n", node->id, idx);
+  TENSOR_FOR(w) fprintf(p_fp, "real_t t%d = w[%zd];\n", node->id, idx);
+  peak = node_slots(yh.data, shape_size(yh.shape), inputs, ++visited);
+  for (int id = inputs; id < inputs + peak; id++)
+    fprintf(p_fp, "real_t t%d;\n", id);
   putc('\n', p_fp);
   ++visited;
-  TENSOR_FOR(yh) node_codegen(p_fp, "double t%d = ", "t%d", node, visited);
-  putc('\n', p_fp);
-  TENSOR_FOR(yh) fprintf(p_fp, "yh[%zd] = t%d;\n", idx, node->id);
+  TENSOR_FOR(yh) {
+    node_codegen(p_fp, "t%d = ", "t%d", node, visited);
+    fprintf(p_fp, "yh[%zd] = t%d;\n", idx, node->id);
+  }
   fprintf(p_fp, "}\n\n");
+  fprintf(stderr, "predict: %d temporaries\n", peak);
 
-  TENSOR_FOR(w) node->grad = node_lit(0.0);
-  c->grad = node_lit(1.0), node_grad(c, ++visited);
+  // the tape serves both `mlp_backprop` and `mlp_backprop_batch`. passing
+  // inputs to `tape_compile` first gives them contiguous slots
+  size_t x_size = shape_size(x.shape), w_size = shape_size(w.shape),
+         y_size = shape_size(y.shape), count = 0;
+  struct node **outs = malloc(sizeof *outs * (x_size + w_size + y_size + 1 +
+                                             w_size));
+  TENSOR_FOR(x) outs[count++] = node;
+  TENSOR_FOR(w) outs[count++] = node;
+  TENSOR_FOR(y) outs[count++] = node;
+  outs[count++] = c;
+  TENSOR_FOR(w) outs[count++] = node->grad;
+  struct tape tape = tape_compile(outs, count, ++visited);
+  for (int i = 0; i < tape.len; i++)
+    tape.nodes[i]->id = i; // so slots can be looked up in constant time
+  // for tools to load the differentiated model without rebuilding it. `roots`
+  // holds the slots of x, w, y, c then dw, in that order
+  tape_save(&tape, "mlp.tape");
+
+  // `mlp_backprop` is split into `SHARDS` functions over consecutive ranges
+  // of the tape, each in its own source file, so they compile in parallel and
+  // are each small enough to optimize fully. values that one shard computes
+  // and a later one reads are spilled to a buffer passed to every shard.
+  // inputs count as computed by shard 0. `c` and every element of `dw` are
+  // accumulated right after the value they add up is computed, and inputs
+  // and spills are loaded right before their first use, as values live for
+  // long stretches of a shard make register allocation slow
+  int *shard = malloc(sizeof *shard * tape.len);
+  int *spill = malloc(sizeof *spill * tape.len); // index into spills, or -1
+  int *loaded = malloc(sizeof *loaded * tape.len); // last shard to load slot
+  int *accum = malloc(sizeof *accum * tape.len); // first root at slot, or -1
+  int *accum_next = malloc(sizeof *accum_next * (1 + w_size)); // c, then dw
+  int spills = 0;
+  for (int i = 0; i < tape.len; i++) {
+    shard[i] = i < inputs ? 0
+                          : (long long)(i - inputs) * SHARDS /
+                                (tape.len - inputs);
+    spill[i] = loaded[i] = accum[i] = -1;
+  }
+  for (int r = w_size; r >= 0; r--) {
+    int slot = tape.roots[x_size + w_size + y_size + r];
+    accum_next[r] = accum[slot], accum[slot] = r;
+  }
+  for (int i = inputs; i < tape.len; i++) {
+    int operands[] = {tape.ops[i].lhs, tape.ops[i].rhs};
+    for (int k = 0; k < 2; k++)
+      if (operands[k] >= inputs && shard[operands[k]] < shard[i] &&
+          spill[operands[k]] == -1)
+        spill[operands[k]] = spills++;
+  }
+
+  // within a shard, values are held in temporaries handed out by a linear
+  // scan over its statements, as `node_slots` does for whole graphs. `last`
+  // holds the last slot of the shard reading a value, counting spilling and
+  // accumulating a value as reading it where it is computed. `id`s are
+  // borrowed to hold the temporary of every value
+  int *last = malloc(sizeof *last * tape.len);
+  int *idle = malloc(sizeof *idle * tape.len), temps_peak = 0;
+  ++visited;
+  for (int k = 0; k < SHARDS; k++) {
+    char path[32];
+    snprintf(path, sizeof path, "mlp-backprop-%d.c", k);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+      perror("fopen"), exit(EXIT_FAILURE);
+    fprintf(fp, "#include \"mlp.h\"\n");
+    fprintf(fp, "#include \"runtime.h\"\n");
+    fprintf(fp, "void mlp_backprop_%d(x_t x, w_t w, y_t y, dw_t dw, c_t c, "
+                "real_t *s) {\n", k);
+    fprintf(fp, "(void)x, (void)w, (void)y, (void)dw, (void)c, (void)s;\n");
+
+    for (int i = 0; i < tape.len; i++)
+      if (shard[i] == k) {
+        last[i] = i;
+        if (tape.ops[i].lhs != -1)
+          last[tape.ops[i].lhs] = i;
+        if (tape.ops[i].rhs != -1)
+          last[tape.ops[i].rhs] = i;
+      }
+
+    int temps = 0, idles = 0;
+    for (int i = 0; i < tape.len; i++) {
+      if (shard[i] != k)
+        continue;
+      int operands[] = {tape.ops[i].lhs, tape.ops[i].rhs, i};
+      for (int o = 0; o < 3; o++) {
+        int j = operands[o];
+        if (j < 0 || loaded[j] == k || (j >= inputs && shard[j] == k) ||
+            (j == i && accum[j] == -1))
+          continue;
+        int t = gen_temp(fp, idle, &idles, &temps);
+        if (j >= inputs)
+          fprintf(fp, "t%d = s[%d];\n", t, spill[j]);
+        else
+          gen_load(fp, t, j, x_size, w_size);
+        tape.nodes[j]->id = t, loaded[j] = k;
+      }
+      // operands dying here free their temporary before the result takes one,
+      // which is fine because C evaluates operands before assigning the result
+      for (int o = 0; o < 2; o++)
+        if (operands[o] >= 0 && last[operands[o]] == i &&
+            (o == 0 || operands[1] != operands[0]))
+          idle[idles++] = tape.nodes[operands[o]]->id;
+      if (i >= inputs) {
+        tape.nodes[i]->id = gen_temp(fp, idle, &idles, &temps);
+        node_codegen(fp, "t%d = ", "t%d", tape.nodes[i], visited);
+      }
+      if (spill[i] != -1)
+        fprintf(fp, "s[%d] = t%d;\n", spill[i], tape.nodes[i]->id);
+      for (int r = accum[i]; r != -1; r = accum_next[r])
+        if (r == 0)
+          fprintf(fp, "*c += t%d;\n", tape.nodes[i]->id);
+        else
+          fprintf(fp, "dw[%d] += t%d;\n", r - 1, tape.nodes[i]->id);
+      if (last[i] == i && (i >= inputs || loaded[i] == k))
+        idle[idles++] = tape.nodes[i]->id;
+    }
+    fprintf(fp, "}\n");
+    temps_peak = temps > temps_peak ? temps : temps_peak;
+
+    if (fclose(fp) == EOF)
+      perror("fclose"), exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < tape.len; i++)
+    tape.nodes[i]->id = i;
+  free(last), free(idle);
+  free(shard), free(spill), free(loaded), free(accum), free(accum_next);
 
   fprintf(b_fp, "#include \"mlp.h\"\n");
   fprintf(b_fp, "#include \"runtime.h\"\n");
-  fprintf(h_fp, "typedef double y_t[%zd];\n", shape_size(y.shape));
-  fprintf(h_fp, "typedef double dw_t[%zd];\n", shape_size(w.shape));
-  fprintf(h_fp, "typedef double c_t[1];\n");
+  fprintf(h_fp, "typedef %s y_t[%zd];\n", REAL, shape_size(y.shape));
+  fprintf(h_fp, "typedef %s dw_t[%zd];\n", REAL, shape_size(w.shape));
+  fprintf(h_fp, "typedef %s c_t[1];\n", REAL);
   fprintf(h_fp, "void mlp_backprop(x_t x, w_t w, y_t y, dw_t dw, c_t c);\n");
+  for (int k = 0; k < SHARDS; k++)
+    fprintf(b_fp, "void mlp_backprop_%d(x_t x, w_t w, y_t y, dw_t dw, c_t c, "
+                  "real_t *s);\n", k);
   fprintf(b_fp, "void mlp_backprop(x_t x, w_t w, y_t y, dw_t dw, c_t c) {\n");
-  TENSOR_FOR(x) fprintf(b_fp, "double t%d = x[%zd];\n", node->id, idx);
-  TENSOR_FOR(w) fprintf(b_fp, "double t%d = w[%zd];\n", node->id, idx);
-  TENSOR_FOR(y) fprintf(b_fp, "double t%d = y[%zd];\n", node->id, idx);
-  putc('\n', b_fp);
-  node_codegen(b_fp, "double t%d = ", "t%d", c, ++visited);
-  TENSOR_FOR(w) node_codegen(b_fp, "double t%d = ", "t%d", node->grad, visited);
-  putc('\n', b_fp);
-  fprintf(b_fp, "*c += t%d;\n", c->id);
-  TENSOR_FOR(w) fprintf(b_fp, "dw[%zd] += t%d;\n", idx, node->grad->id);
+  fprintf(b_fp, "real_t s[%d];\n", spills);
+  for (int k = 0; k < SHARDS; k++)
+    fprintf(b_fp, "mlp_backprop_%d(x, w, y, dw, c, s);\n", k);
   fprintf(b_fp, "}\n");
+  fprintf(stderr, "backprop: %d shards, %d spills, %d temporaries\n", SHARDS,
+          spills, temps_peak);
+
+  // same as `mlp_backprop`, but evaluates every temporary over a lane of
+  // `MLP_LANES` examples at once. temporaries live in a `scratch_t` the caller
+  // allocates once per thread, as it is too large for the stack, and weights
+  // are broadcast into it by `mlp_backprop_load` once per weight update rather
+  // than on every call. padding lanes of the last block repeat its first
+  // example but are not accumulated
+  fprintf(bb_fp, "#include \"mlp.h\"\n");
+  fprintf(bb_fp, "#include \"runtime.h\"\n");
+  tape_codegen(bb_fp, "mlp_lanes", "MLP_LANES", &tape);
+  fprintf(bb_fp, "\nstatic const int dw_slots[%zd] = {\n", w_size);
+  TENSOR_FOR(w) fprintf(bb_fp, "%d,\n", node->grad->id);
+  fprintf(bb_fp, "};\n\n");
+  fprintf(h_fp, "#define MLP_LANES %d\n", LANES);
+  fprintf(h_fp, "typedef real_t scratch_t[%d][MLP_LANES];\n", tape.len);
+  fprintf(h_fp, "void mlp_backprop_load(w_t w, scratch_t s);\n");
+  fprintf(h_fp, "void mlp_backprop_batch(int n, x_t *x[], y_t *y[], "
+                "scratch_t s, dw_t dw, c_t c);\n");
+  fprintf(bb_fp, "void mlp_backprop_load(w_t w, scratch_t s) {\n");
+  fprintf(bb_fp, "for (int i = 0; i < %zd; i++)\n", w_size);
+  fprintf(bb_fp, "for (int l = 0; l < MLP_LANES; l++)\n");
+  fprintf(bb_fp, "s[%zd + i][l] = w[i];\n", x_size);
+  fprintf(bb_fp, "}\n\n");
+  fprintf(bb_fp, "void mlp_backprop_batch(int n, x_t *x[], y_t *y[], "
+                 "scratch_t s, dw_t dw, c_t c) {\n");
+  fprintf(bb_fp, "for (int b = 0; b < n; b += MLP_LANES) {\n");
+  fprintf(bb_fp, "for (int l = 0; l < MLP_LANES; l++) {\n");
+  fprintf(bb_fp, "int e = b + l < n ? b + l : b;\n");
+  fprintf(bb_fp, "for (int i = 0; i < %zd; i++)\n", x_size);
+  fprintf(bb_fp, "s[i][l] = (*x[e])[i];\n");
+  fprintf(bb_fp, "for (int i = 0; i < %zd; i++)\n", y_size);
+  fprintf(bb_fp, "s[%zd + i][l] = (*y[e])[i];\n", x_size + w_size);
+  fprintf(bb_fp, "}\n");
+  fprintf(bb_fp, "mlp_lanes(s);\n");
+  fprintf(bb_fp, "for (int l = 0; l < MLP_LANES && b + l < n; l++) {\n");
+  fprintf(bb_fp, "*c += s[%d][l];\n", c->id);
+  fprintf(bb_fp, "for (int i = 0; i < %zd; i++)\n", w_size);
+  fprintf(bb_fp, "dw[i] += s[dw_slots[i]][l];\n");
+  fprintf(bb_fp, "}\n");
+  fprintf(bb_fp, "}\n");
+  fprintf(bb_fp, "}\n");
+  tape_free(&tape), free(outs);
 
-  if (fclose(p_fp) == EOF || fclose(b_fp) == EOF || fclose(h_fp) == EOF)
+  if (fclose(p_fp) == EOF || fclose(b_fp) == EOF || fclose(bb_fp) == EOF ||
+      fclose(h_fp) == EOF)
     perror("fclose"), exit(EXIT_FAILURE);
 
-  struct node *nodes = NULL;
-  node_mark(c, &nodes, 0, ++visited), node_free(nodes, visited);
+  if (STATS)
+    node_timings_print(stderr);
+
+  arena_destroy(arena);
   free(x.data), free(yh.data), free(w.data), free(y.data);
 }
@@ -0,0 +1,165 @@
+#include "lib/autodiff.h"
+#include "lib/tensor.h"
+#include "lib/tnode.h"
+#include <stdlib.h>
+
+// same model as mlp-gen.c, built out of `struct tnode`s instead. generates
+// loops over arrays, so the generated source scales with the number of layers
+// rather than the number of weights
+
+// softmax and cross-entropy are computed from the log-softmax, so large
+// logits neither overflow `exp` nor take the log of zero
+
+static struct tnode *tnode_logsoftmax(struct tnode *tnode) {
+  return tnode_binop(node_sub, tnode,
+                     tnode_repeat(tnode->shape, tnode_logsumexp(tnode)));
+}
+
+static struct tnode *tnode_softmax(struct tnode *tnode) {
+  return tnode_unop(node_exp, tnode_logsoftmax(tnode));
+}
+
+static struct tnode *tnode_softmax_crossentropy(struct tnode *y,
+                                                struct tnode *z) {
+  return tnode_unop(node_neg,
+                    tnode_sum(tnode_binop(node_mul, y, tnode_logsoftmax(z))));
+}
+
+static struct tnode *tnode_dense(struct tnode *w, struct tnode *b,
+                                 struct tnode *l) {
+  return tnode_binop(node_add, b, tnode_matmul(w, l));
+}
+
+// precision of generated code in bits, either 32 or 64. see runtime.h
+#ifndef PRECISION
+#define PRECISION 64
+#endif
+#define REAL (PRECISION == 32 ? "float" : "double")
+
+int main(void) {
+  struct tnode *x = tnode_input((shape_t){28 * 28, 1});
+
+  struct tnode *b1 = tnode_input((shape_t){64, 1});
+  struct tnode *w1 = tnode_input((shape_t){*b1->shape, *x->shape});
+  struct tnode *l1 = tnode_unop(node_relu, tnode_dense(w1, b1, x));
+
+  struct tnode *b2 = tnode_input((shape_t){32, 1});
+  struct tnode *w2 = tnode_input((shape_t){*b2->shape, *l1->shape});
+  struct tnode *l2 = tnode_unop(node_relu, tnode_dense(w2, b2, l1));
+
+  struct tnode *b3 = tnode_input((shape_t){10, 1});
+  struct tnode *w3 = tnode_input((shape_t){*b3->shape, *l2->shape});
+  struct tnode *z3 = tnode_dense(w3, b3, l2);
+  struct tnode *yh = tnode_softmax(z3);
+
+  struct tnode *y = tnode_input(yh->shape);
+  struct tnode *c = tnode_softmax_crossentropy(y, z3);
+
+  // in the same order as `tensor_collect` in mlp-gen.c
+  struct tnode *w[] = {w1, w2, w3, b1, b2, b3, NULL};
+  size_t w_size = 0;
+  for (struct tnode **wi = w; *wi; wi++)
+    w_size += shape_size((*wi)->shape);
+
+  FILE *p_fp = fopen("mlp-predict.c", "w");
+  FILE *b_fp = fopen("mlp-backprop.c", "w");
+  FILE *h_fp = fopen("mlp.h", "w");
+  if (p_fp == NULL || b_fp == NULL || h_fp == NULL)
+    perror("fopen"), exit(EXIT_FAILURE);
+
+  int visited = 0;
+  size_t ofst, p_used, b_used;
+
+  if (PRECISION == 32)
+    fprintf(h_fp, "#define RUNTIME_FLOAT\n");
+  fprintf(h_fp, "typedef %s real_t;\n", REAL); // same as in runtime.h
+  fprintf(p_fp, "#include \"mlp.h\"\n");
+  fprintf(p_fp, "#include \"runtime.h\"\n");
+  fprintf(h_fp, "typedef %s x_t[%zd];\n", REAL, shape_size(x->shape));
+  fprintf(h_fp, "typedef %s w_t[%zd];\n", REAL, w_size);
+  fprintf(h_fp, "typedef %s yh_t[%zd];\n", REAL, shape_size(yh->shape));
+  fprintf(h_fp, "void mlp_predict(x_t x, w_t w, yh_t yh);\n");
+  fprintf(p_fp, "static void predict(x_t x, w_t w, yh_t yh, "
+                "real_t *scratch) {\n");
+  fprintf(p_fp, "real_t *t%d = x;\n", x->id);
+  ofst = 0;
+  for (struct tnode **wi = w; *wi; ofst += shape_size((*wi++)->shape))
+    fprintf(p_fp, "real_t *t%d = w + %zd;\n", (*wi)->id, ofst);
+  putc('\n', p_fp);
+  p_used = tnode_codegen(p_fp, yh, 0, ++visited);
+  putc('\n', p_fp);
+  fprintf(p_fp, "for (int i = 0; i < %zd; i++)\n", shape_size(yh->shape));
+  fprintf(p_fp, "yh[i] = t%d[i];\n", yh->id);
+  fprintf(p_fp, "}\n\n");
+  // the forward pass alone is small enough for the stack
+  fprintf(p_fp, "void mlp_predict(x_t x, w_t w, yh_t yh) {\n");
+  fprintf(p_fp, "real_t scratch[%zd];\n", p_used);
+  fprintf(p_fp, "predict(x, w, yh, scratch);\n");
+  fprintf(p_fp, "}\n");
+  fprintf(stderr, "predict: %zd reals of scratch\n", p_used);
+
+  c->grad = tnode_lit(c->shape, 1.0), tnode_grad(c, &visited);
+
+  fprintf(b_fp, "#include \"mlp.h\"\n");
+  fprintf(b_fp, "#include \"runtime.h\"\n");
+  fprintf(h_fp, "typedef %s y_t[%zd];\n", REAL, shape_size(y->shape));
+  fprintf(h_fp, "typedef %s dw_t[%zd];\n", REAL, w_size);
+  fprintf(h_fp, "typedef %s c_t[1];\n", REAL);
+  fprintf(h_fp, "void mlp_backprop(x_t x, w_t w, y_t y, dw_t dw, c_t c);\n");
+  fprintf(b_fp, "static void backprop(x_t x, w_t w, y_t y, dw_t dw, c_t c, "
+                "real_t *scratch) {\n");
+  fprintf(b_fp, "real_t *t%d = x;\n", x->id);
+  ofst = 0;
+  for (struct tnode **wi = w; *wi; ofst += shape_size((*wi++)->shape))
+    fprintf(b_fp, "real_t *t%d = w + %zd;\n", (*wi)->id, ofst);
+  fprintf(b_fp, "real_t *t%d = y;\n", y->id);
+  putc('\n', b_fp);
+  b_used = tnode_codegen(b_fp, c, 0, ++visited);
+  for (struct tnode **wi = w; *wi; wi++)
+    b_used = tnode_codegen(b_fp, (*wi)->grad, b_used, visited);
+  putc('\n', b_fp);
+  fprintf(b_fp, "*c += t%d[0];\n", c->id);
+  ofst = 0;
+  for (struct tnode **wi = w; *wi; ofst += shape_size((*wi++)->shape)) {
+    fprintf(b_fp, "for (int i = 0; i < %zd; i++)\n", shape_size((*wi)->shape));
+    fprintf(b_fp, "dw[%zd + i] += t%d[i];\n", ofst, (*wi)->grad->id);
+  }
+  fprintf(b_fp, "}\n\n");
+  // the backward pass needs too much scratch for the stack, so
+  // `mlp_backprop` gets a static one per thread
+  fprintf(b_fp, "void mlp_backprop(x_t x, w_t w, y_t y, dw_t dw, c_t c) {\n");
+  fprintf(b_fp, "static _Thread_local real_t scratch[%zd];\n", b_used);
+  fprintf(b_fp, "backprop(x, w, y, dw, c, scratch);\n");
+  fprintf(b_fp, "}\n\n");
+  fprintf(stderr, "backprop: %zd reals of scratch\n", b_used);
+
+  // loops already vectorize over elements, so there is nothing to gain from
+  // evaluating lanes of examples at once: `mlp_backprop_batch` evaluates its
+  // examples one after the other, and `MLP_LANES` only sets how many examples
+  // mlp-fit hands it per call. the scratch holds a copy of the weights, for
+  // the same interface as mlp-gen.c, then that of `backprop`
+  fprintf(h_fp, "#define MLP_LANES 8 // examples per call, not lanes\n");
+  fprintf(h_fp, "typedef %s scratch_t[%zd];\n", REAL, w_size + b_used);
+  fprintf(h_fp, "void mlp_backprop_load(w_t w, scratch_t s);\n");
+  fprintf(h_fp, "void mlp_backprop_batch(int n, x_t *x[], y_t *y[], "
+                "scratch_t s, dw_t dw, c_t c);\n");
+  fprintf(b_fp, "void mlp_backprop_load(w_t w, scratch_t s) {\n");
+  fprintf(b_fp, "for (int i = 0; i < %zd; i++)\n", w_size);
+  fprintf(b_fp, "s[i] = w[i];\n");
+  fprintf(b_fp, "}\n\n");
+  fprintf(b_fp, "void mlp_backprop_batch(int n, x_t *x[], y_t *y[], "
+                "scratch_t s, dw_t dw, c_t c) {\n");
+  fprintf(b_fp, "for (int i = 0; i < n; i++)\n");
+  fprintf(b_fp, "backprop(*x[i], s, *y[i], dw, c, s + %zd);\n", w_size);
+  fprintf(b_fp, "}\n");
+
+  if (fclose(p_fp) == EOF || fclose(b_fp) == EOF || fclose(h_fp) == EOF)
+    perror("fclose"), exit(EXIT_FAILURE);
+
+  struct tnode *tnodes = NULL;
+  tnode_mark(c, &tnodes, 0, ++visited);
+  tnode_mark(yh, &tnodes, 0, visited);
+  for (struct tnode **wi = w; *wi; wi++)
+    tnode_mark((*wi)->grad, &tnodes, 0, visited);
+  tnode_free(tnodes, &visited);
+}
@@ -1,9 +1,11 @@
 #include "lib/autodiff.h"
+#include "lib/tape.h"
 #include <math.h>
+#include <stdlib.h>
 
 #define FUNC(X) node_log(X)          // function to approximate
 #define CENTER (LOWER + UPPER) / 2.0 // center of expansion
-#define DEGREE 8                     // degree of polynomial (plus one)
+#define DEGREE 16                    // degree of polynomial (plus one)
 
 #define LOWER 1.0      // closed lower bound for test interval
 #define UPPER exp(1.0) // open upper bound for test interval
@@ -13,36 +15,23 @@ struct node *taylor(struct node *f, struct node *x, int N, int *visited) {
   // returns the `N`th taylor polynomial of `f(x)` around the center of
   // expansion `x->val`. consumes `f` and returns a function of `x`
 
-  struct node *x0 = node_sub(x, node_lit(x->val));
+  double *coefs = malloc(sizeof *coefs * (N ? N : 1)); // `n`th derivatives
+  if (N)                                                // divided by `n!`
+    node_taylor(f, x, coefs, N, ++*visited);
 
-  double fact_n = 1.0;   // factorial of `n`
-  struct node *df_n = f; // `n`th derivative of `f`
-  struct node *p_n =     // `n`th taylor polynomial
-      node_lit(N ? node_eval(f, ++*visited), f->val : 0.0);
-  struct node *x0_n = node_lit(1.0); // `n`th power of `x - x->val`
-
-  for (int n = 1; n < N; n++) {
-    // derivate `df_n` with respect to `x`
-    struct node *grad;
-    x->grad = node_lit(0.0); // assume `f != x`
-    df_n->grad = node_lit(1.0), node_grad(df_n, ++*visited);
-    grad = x->grad, x->grad = NULL;
-
-    // garbage collect
-    struct node *nodes = NULL, *rest = NULL;
-    node_mark(x0, &nodes, 0, ++*visited); // `grad` may not depend on `x0`
-    node_mark(grad, &nodes, 0, *visited), node_mark(df_n, &rest, 0, *visited);
-    node_zerograd(nodes, *visited), node_free(rest, *visited);
-
-    // build the term
-    node_eval(df_n = grad, ++*visited);
-    x0_n = node_mul(x0_n, x0), fact_n *= n;
-    p_n = node_add(p_n, node_mul(node_lit(df_n->val / fact_n), x0_n));
+  // build the polynomial using Horner's method
+  struct node *p_n = node_lit(N ? coefs[N - 1] : 0.0);
+  if (N > 1) {
+    struct node *x0 = node_sub(x, node_lit(x->val));
+    for (int n = N - 1; n--;)
+      p_n = node_add(node_mul(p_n, x0), node_lit(coefs[n]));
   }
+  free(coefs);
 
+  // garbage collect
   struct node *nodes = NULL;
   node_mark(p_n, NULL, 0, ++*visited);
-  node_mark(df_n, &nodes, 0, *visited), node_free(nodes, *visited);
+  node_mark(f, &nodes, 0, *visited), node_free(nodes, *visited);
 
   return p_n;
 }
@@ -62,13 +51,22 @@ int main(void) {
   fprintf(fp, "return t%d;\n", p_n->id);
   fprintf(fp, "}\n");
 
+  // evaluate `f` and `p_n` at every step at once, one step per lane
+  struct tape tape = tape_compile((struct node *[]){f, p_n}, 2, ++visited);
+  double *lanes = tape_lanes(&tape, STEPS);
+  double *x_lane = lanes + tape_slot(&tape, x) * STEPS;
+  double *f_lane = lanes + tape_slot(&tape, f) * STEPS;
+  double *p_n_lane = lanes + tape_slot(&tape, p_n) * STEPS;
+  for (int step = 0; step < STEPS; step++)
+    x_lane[step] = LOWER + (double)(UPPER - LOWER) / STEPS * step;
+  tape_eval_lanes(&tape, lanes, STEPS);
+
   double rmse = 0.0, l_inf = 0.0;
   for (int step = 0; step < STEPS; step++) {
-    x->val = LOWER + (double)(UPPER - LOWER) / STEPS * step;
-    node_eval(f, ++visited), node_eval(p_n, visited);
-    double delta = f->val - p_n->val;
+    double delta = f_lane[step] - p_n_lane[step];
     rmse += delta * delta, l_inf = fmax(l_inf, fabs(delta));
   }
+  free(lanes), tape_free(&tape);
   rmse = sqrt(rmse / STEPS);
   printf("rmse: %f; l_inf: %f\n", rmse, l_inf);
 
@@ -1,3 +1,5 @@
+#include <math.h>
+
 static struct node *node_id(struct node *node) { return node; }
 
 static struct node *node_double(struct node *node) {
@@ -16,18 +18,8 @@ static struct node *node_cube(struct node *node) {
   return node_mul(node, node_square(node));
 }
 
-static struct node *node_sigmoid(struct node *node) {
-  return node_inv(node_add(node_lit(1.0), node_exp(node_neg(node))));
-}
-
-static struct node *node_tanh(struct node *node) {
-  struct node *exp_2x = node_exp(node_double(node));
-  return node_div(node_sub(exp_2x, node_lit(1.0)),
-                  node_add(exp_2x, node_lit(2.0)));
-}
-
 static struct node *tensor_sum(bool move_tensor, struct tensor tensor) {
-  return tensor_fold(node_lit(0.0), node_add, move_tensor, tensor);
+  return tensor_reduce(node_add, move_tensor, tensor);
 }
 
 static struct node *tensor_mean(bool move_tensor, struct tensor tensor) {
@@ -69,10 +61,25 @@ static struct node *tensor_crossentropy(bool move_y, struct tensor y,
       tensor_dot(move_y, y, MOVE tensor_unop(node_log, move_yh, yh)));
 }
 
+static struct node *tensor_logsumexp(bool move_tensor, struct tensor tensor) {
+  return tensor_reduce(node_logaddexp, move_tensor, tensor);
+}
+
+static struct tensor tensor_logsoftmax(bool move_tensor,
+                                       struct tensor tensor) {
+  struct tensor lse = tensor_repeat(tensor.shape, tensor_logsumexp(REF tensor));
+  return tensor_binop(node_sub, move_tensor, tensor, MOVE lse);
+}
+
 static struct tensor tensor_softmax(bool move_tensor, struct tensor tensor) {
-  struct tensor exp = tensor_unop(node_exp, move_tensor, tensor);
-  struct tensor sum = tensor_repeat(exp.shape, tensor_sum(REF exp));
-  return tensor_binop(node_div, MOVE exp, MOVE sum);
+  return tensor_unop(node_exp, MOVE tensor_logsoftmax(move_tensor, tensor));
+}
+
+static struct node *tensor_softmax_crossentropy(bool move_y, struct tensor y,
+                                                bool move_z, struct tensor z) {
+  // `tensor_crossentropy` of `tensor_softmax` of `z`, from the log-softmax
+  // directly rather than from the log of exponentials
+  return node_neg(tensor_dot(move_y, y, MOVE tensor_logsoftmax(move_z, z)));
 }
 
 static struct tensor row_tensor(bool move_tensor, struct tensor tensor) {